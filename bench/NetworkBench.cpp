@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <network/Listener.h>
+#include <network/PushConnection.h>
+#include <flatbuffers/bench/BenchMessage.h>
+
+/*
+ * Loopback echo benchmark for Connection and PushConnection, plain and TLS.
+ *
+ * Each run starts a Listener echoing BenchMessages and a number of client connections, each doing request/response
+ * exchanges with writeProtoClass/readProtoClass for a fixed duration. Results are printed as one JSON object per run
+ * and line, so runs of different releases can be diffed.
+ *
+ * Usage: Commons_Bench [--duration ms] [--sizes 64,1024] [--connections 1,8] [--clients connection,push] [--no-tls]
+ *                      [--no-delay] [--output file]
+ */
+
+// self-signed certificate generated at build time, see CMakeLists.txt
+#ifdef BENCH_CERT
+#define BENCH_HAS_CERT
+#else
+#define BENCH_CERT ""
+#define BENCH_KEY ""
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::chrono::milliseconds duration {1000};
+    std::vector<uint32_t> sizes {64, 1024, 16384};
+    std::vector<uint32_t> connections {1, 8, 32};
+    std::vector<std::string> clients {"connection", "push"};
+    bool tls = true;
+    // sets TCP_NODELAY on both ends, messages larger than a TLS record otherwise wait for delayed ACKs
+    bool noDelay = false;
+    std::string output;
+};
+
+struct Run {
+    std::string client;
+    bool tls;
+    uint32_t size, connections;
+};
+
+struct Result {
+    uint64_t messages = 0;
+    double seconds = 0;
+    // round trip times in nanoseconds, sorted
+    std::vector<uint64_t> latencies;
+};
+
+// exchanges before measuring, to warm up caches and the TLS session
+static const uint32_t WARMUP = 50;
+
+static std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> result;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            result.push_back(item);
+    return result;
+}
+
+static std::vector<uint32_t> splitNumbers(const std::string &list) {
+    std::vector<uint32_t> result;
+    for (auto &item : split(list))
+        result.push_back(static_cast<uint32_t>(std::stoul(item)));
+    return result;
+}
+
+static bool parseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--no-tls")
+            options.tls = false;
+        else if (arg == "--no-delay")
+            options.noDelay = true;
+        else if (arg == "--duration" && hasValue)
+            options.duration = std::chrono::milliseconds(std::stoul(argv[++i]));
+        else if (arg == "--sizes" && hasValue)
+            options.sizes = splitNumbers(argv[++i]);
+        else if (arg == "--connections" && hasValue)
+            options.connections = splitNumbers(argv[++i]);
+        else if (arg == "--clients" && hasValue)
+            options.clients = split(argv[++i]);
+        else if (arg == "--output" && hasValue)
+            options.output = argv[++i];
+        else
+            return false;
+    }
+
+    for (auto &client : options.clients)
+        if (client != "connection" && client != "push")
+            return false;
+    return std::find(options.connections.begin(), options.connections.end(), 0u) == options.connections.end();
+}
+
+/**
+ * Blocking exchange using Connection
+ */
+static bool exchange(Connection &conn, const BenchMessage &request, BenchMessage &response) {
+    return conn.writeProtoClass(request) && conn.readProtoClass(response);
+}
+
+/**
+ * Exchange using PushConnection's non-blocking read path
+ */
+static bool exchange(PushConnection &conn, const BenchMessage &request, BenchMessage &response) {
+    if (!conn.writeProtoClass(request))
+        return false;
+
+    int res;
+    while ((res = conn.readProtoClass(response)) == 0) {
+        bool readable, notify;
+        if (!conn.waitReadable(readable, notify))
+            return false;
+    }
+    return res == 1;
+}
+
+/**
+ * Starts all clients at once after they connected and warmed up
+ */
+class StartGate {
+public:
+    explicit StartGate(uint32_t count) : mWaiting(count) { }
+
+    // returns the common deadline
+    Clock::time_point arrive(std::chrono::milliseconds duration) {
+        std::unique_lock<std::mutex> guard(mLock);
+        if (--mWaiting == 0) {
+            mStart = Clock::now();
+            mDeadline = mStart + duration;
+            mOpen.notify_all();
+        }
+        else
+            mOpen.wait(guard, [this] () { return mWaiting == 0; });
+        return mDeadline;
+    }
+
+    // only valid once all clients arrived
+    Clock::time_point start() const {
+        return mStart;
+    }
+
+protected:
+    std::mutex mLock;
+    std::condition_variable mOpen;
+    uint32_t mWaiting;
+    Clock::time_point mStart, mDeadline;
+};
+
+template<typename Conn>
+static void client(const ConnectionInfo &info, uint32_t size, std::chrono::milliseconds duration, StartGate &gate,
+                   std::vector<uint64_t> &latencies, Clock::time_point &end, std::atomic<bool> &failed) {
+    Conn conn(info);
+    BenchMessage request, response;
+    std::vector<uint8_t> payload(size, 0x5a);
+    request.payload(payload.data(), size);
+
+    bool ok = true;
+    try {
+        conn.connect();
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Connect failed: " << e.what() << std::endl;
+        ok = false;
+    }
+
+    for (uint32_t i = 0; ok && i < WARMUP; i++)
+        ok = exchange(conn, request, response);
+
+    // wait for all other clients even on failure, they would wait forever otherwise
+    Clock::time_point deadline = gate.arrive(duration);
+
+    for (uint32_t sequence = 0; ok && Clock::now() < deadline; sequence++) {
+        request.sequence(sequence);
+
+        auto start = Clock::now();
+        ok = exchange(conn, request, response) && response.sequence() == sequence;
+        latencies.push_back(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - start).count()));
+    }
+
+    end = Clock::now();
+    if (!ok)
+        failed = true;
+}
+
+static bool bench(const Run &run, const Options &options, Result &result) {
+    SocketOptions socketOptions;
+    socketOptions.noDelay = options.noDelay;
+
+    ConnectionInfo local("127.0.0.1", 0, run.tls);
+    local.setSocketOptions(socketOptions);
+    Listener listener(local, run.tls ? BENCH_CERT : "", run.tls ? BENCH_KEY : "");
+    listener.listen();
+
+    // echo server, one thread per connection
+    std::vector<std::thread> echoes;
+    std::thread acceptor([&listener, &echoes] () {
+        while (auto conn = listener.accept()) {
+            std::shared_ptr<Connection> shared(std::move(conn));
+            echoes.emplace_back([shared] () {
+                BenchMessage message;
+                while (shared->readProtoClass(message) && shared->writeProtoClass(message));
+            });
+        }
+    });
+
+    // loopback certificate is self-signed
+    ConnectionInfo info("127.0.0.1", listener.port(), run.tls, false);
+    info.setSocketOptions(socketOptions);
+    StartGate gate(run.connections);
+    std::atomic<bool> failed(false);
+    std::vector<std::vector<uint64_t>> latencies(run.connections);
+    std::vector<Clock::time_point> ends(run.connections);
+
+    std::vector<std::thread> clients;
+    for (uint32_t i = 0; i < run.connections; i++) {
+        if (run.client == "push")
+            clients.emplace_back(client<PushConnection>, std::cref(info), run.size, options.duration, std::ref(gate),
+                                 std::ref(latencies[i]), std::ref(ends[i]), std::ref(failed));
+        else
+            clients.emplace_back(client<Connection>, std::cref(info), run.size, options.duration, std::ref(gate),
+                                 std::ref(latencies[i]), std::ref(ends[i]), std::ref(failed));
+    }
+    for (auto &thread : clients)
+        thread.join();
+    // connecting and warm up are not measured
+    result.seconds = std::chrono::duration<double>(*std::max_element(ends.begin(), ends.end()) - gate.start()).count();
+
+    listener.close();
+    acceptor.join();
+    for (auto &thread : echoes)
+        thread.join();
+
+    for (auto &connLatencies : latencies)
+        result.latencies.insert(result.latencies.end(), connLatencies.begin(), connLatencies.end());
+    std::sort(result.latencies.begin(), result.latencies.end());
+    result.messages = result.latencies.size();
+
+    return !failed;
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()));
+    // in microseconds
+    return sorted[index] / 1000.0;
+}
+
+static std::string toJson(const Run &run, bool noDelay, const Result &result) {
+    std::ostringstream json;
+    json.setf(std::ios::fixed);
+    json.precision(2);
+
+    double perSec = result.seconds > 0 ? result.messages / result.seconds : 0;
+    json << "{\"client\":\"" << run.client << "\",\"tls\":" << (run.tls ? "true" : "false")
+         << ",\"no_delay\":" << (noDelay ? "true" : "false")
+         << ",\"size\":" << run.size << ",\"connections\":" << run.connections
+         << ",\"messages\":" << result.messages << ",\"seconds\":" << result.seconds
+         << ",\"msgs_per_sec\":" << perSec << ",\"mb_per_sec\":" << perSec * run.size / (1024 * 1024)
+         << ",\"p50_us\":" << percentile(result.latencies, 0.5)
+         << ",\"p99_us\":" << percentile(result.latencies, 0.99)
+         << ",\"p999_us\":" << percentile(result.latencies, 0.999)
+         << ",\"max_us\":" << (result.latencies.empty() ? 0 : result.latencies.back() / 1000.0) << "}";
+    return json.str();
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--duration ms] [--sizes 64,1024] [--connections 1,8] "
+                  << "[--clients connection,push] [--no-tls] [--no-delay] [--output file]" << std::endl;
+        return 2;
+    }
+
+#ifndef BENCH_HAS_CERT
+    // no openssl binary at build time, so no certificate
+    options.tls = false;
+#endif
+
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output, std::ios::trunc);
+        if (!file) {
+            std::cerr << "Cannot write " << options.output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out = options.output.empty() ? std::cout : file;
+
+    std::vector<bool> modes {false};
+    if (options.tls)
+        modes.push_back(true);
+
+    int status = 0;
+    for (bool tls : modes)
+        for (auto &client : options.clients)
+            for (uint32_t size : options.sizes)
+                for (uint32_t connections : options.connections) {
+                    Run run {client, tls, size, connections};
+                    Result result;
+
+                    if (!bench(run, options, result)) {
+                        std::cerr << "Run failed: " << toJson(run, options.noDelay, result) << std::endl;
+                        status = 1;
+                        continue;
+                    }
+
+                    out << toJson(run, options.noDelay, result) << std::endl;
+                }
+
+    return status;
+}
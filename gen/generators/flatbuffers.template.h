@@ -74,6 +74,8 @@ public:
                 elem.lout("{set_wrap_type} __{name}")
             else:
                 elem.lout("{type.ref_type} __{name}")
+            if elem.default_arg is not None:
+                elem.out(" = {default_arg}")
         f_def.outl(") {{")
         for elem in f_def.elements:
             elem.outl("    {name}(__{name});")
@@ -90,6 +92,8 @@ public:
                     elem.lout("const BufferRangeConst &__{name}")
                 else:
                     elem.lout("{type.ref_type} __{name}")
+                if elem.default_arg is not None:
+                    elem.out(" = {default_arg}")
             f_def.outl(") {{")
             for elem in f_def.elements:
                 elem.outl("    {name}(__{name});")
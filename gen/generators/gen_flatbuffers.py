@@ -23,8 +23,9 @@ from common import CogBase, DefBase, read_definition, suggested_type, comment_pa
 from generators.gen_enum import enum_import
 from generators.gen_bit import bit_import
 
-# matches non-array "type name"
-matcher = re.compile(r"(?P<depr>~)?(?P<type>[\w\[\]]*)(?P<size>\([\d]+\))?\s+(?P<name>\w*)" + comment_pattern)
+# matches non-array "type name", optionally followed by "= default" for trailing constructor arguments
+matcher = re.compile(r"(?P<depr>~)?(?P<type>[\w\[\]]*)(?P<size>\([\d]+\))?\s+(?P<name>\w*)"
+                     r"(?:\s*=\s*(?P<default>[^#]*?))?" + comment_pattern)
 # matches "max_size <bytes>"
 size_matcher = re.compile(r"max_size\s+(?P<max_size>\d*)" + comment_pattern)
 
@@ -93,6 +94,8 @@ class FlatbuffersType(CogBase):
         self.type = flatbuffers_type[elem_type] if elem_type is not None else None
         self.name = elem_name
         self.size = elem_size
+        # default argument in the arguments ctors, keeps old ctor calls valid when fields are appended
+        self.default_arg = None
 
         # for wrapped types
         self.wrap_type = None
@@ -144,6 +147,8 @@ class FlatbuffersDef(DefBase, CogBase):
     def __init__(self, filename, outfile):
         DefBase.__init__(self, filename)
         self.max_size = 0
+        # true once a field with default argument was parsed
+        self.has_default = False
 
         # name fbs table after basename of the file
         self.name = splitext(basename(filename))[0]
@@ -202,6 +207,15 @@ class FlatbuffersDef(DefBase, CogBase):
             self.fbs.append(result.fbs_line(is_depr))
 
             # do not add deprecated fields to elements
-            return [] if is_depr else [result]
+            if is_depr:
+                return []
+
+            # defaults are only possible for trailing arguments
+            if match.group('default') is not None:
+                result.default_arg = match.group('default').strip()
+                self.has_default = True
+            elif self.has_default:
+                raise Exception("missing default after field with default on line: " + line)
+            return [result]
 
         raise Exception("parse error on line: " + line)
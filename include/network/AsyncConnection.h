@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMONS_ASYNCCONNECTION_H
+#define COMMONS_ASYNCCONNECTION_H
+
+#include <deque>
+#include <future>
+
+#include <network/EventLoop.h>
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define COMMONS_COROUTINES
+#endif
+#endif
+
+/**
+ * Asynchronous TCP/SSL client driven by an EventLoop. Every operation returns immediately and completes through a
+ * callback or a future, so a single loop thread can keep thousands of exchanges in flight. With C++20, operations can
+ * also be awaited in coroutines.
+ *
+ * Reads and writes complete in the order they were issued. Callbacks run on an event loop thread (connects on a
+ * connect worker) and may issue further operations. Operations issued while connecting are queued until the connect
+ * finished, operations issued while not connected fail immediately. Once enough received data is buffered without a
+ * read to consume it, reading from the socket pauses until the next read is issued.
+ */
+class AsyncConnection : Connection {
+public:
+    /**
+     * Called once an operation completed
+     *
+     * @param success False if the operation failed or the connection was closed
+     */
+    using Done = std::function<void(bool success)>;
+
+    /**
+     * @param loop Event loop driving this connection, must outlive it
+     * @param info Connection information
+     */
+    AsyncConnection(EventLoop &loop, ConnectionInfo info) : Connection(std::move(info)), mLoop(loop) { }
+
+    /**
+     * Waits for a running connect, then disconnects. Pending operations fail.
+     */
+    ~AsyncConnection();
+
+    /**
+     * Establishes the connection on a connect worker, since resolving and the TLS handshake may block
+     *
+     * @param done Called once connected or failed
+     */
+    void connect(Done done);
+
+    /**
+     * Establishes the connection on a connect worker
+     *
+     * @return Future that is ready once connected, holds async_connection_error on failure
+     */
+    std::future<void> connect() {
+        auto promise = std::make_shared<std::promise<void>>();
+        connect([promise] (bool success) {
+            if (success)
+                promise->set_value();
+            else
+                reject(*promise, "Connect failed");
+        });
+        return promise->get_future();
+    }
+
+    /**
+     * Closes the connection. Pending operations fail.
+     */
+    void disconnect();
+
+    /**
+     * Reads a protocol generated class once enough data was received
+     *
+     * @param done Called with the class, which is only valid if success is true
+     */
+    template<typename T>
+    void readProtoClass(std::function<void(bool success, T &pgen)> done) {
+        auto pgen = std::make_shared<T>();
+        enqueueRead([this, pgen] () { return parseProtoClass(*pgen); },
+                    [pgen, done] (bool success) { done(success, *pgen); });
+    }
+
+    /**
+     * Reads a protocol generated class once enough data was received
+     *
+     * @return Future of the class, holds async_connection_error on failure
+     */
+    template<typename T>
+    std::future<T> readProtoClass() {
+        auto promise = std::make_shared<std::promise<T>>();
+        readProtoClass<T>([promise] (bool success, T &pgen) {
+            if (success)
+                promise->set_value(std::move(pgen));
+            else
+                reject(*promise, "Read failed");
+        });
+        return promise->get_future();
+    }
+
+    /**
+     * Writes a protocol generated class without blocking, the rest is sent once the socket becomes writable
+     *
+     * @param pgen the class to write, needs to have T::serialize(const Buffer&)
+     * @param done Called once all bytes were handed to the socket
+     */
+    template<typename T>
+    void writeProtoClass(const T &pgen, Done done) {
+        Buffer buffer;
+        pgen.serialize(buffer);
+        enqueueWrite(buffer, std::move(done));
+    }
+
+    /**
+     * Writes a protocol generated class without blocking
+     *
+     * @return Future that is ready once all bytes were handed to the socket, holds async_connection_error on failure
+     */
+    template<typename T>
+    std::future<void> writeProtoClass(const T &pgen) {
+        auto promise = std::make_shared<std::promise<void>>();
+        writeProtoClass(pgen, [promise] (bool success) {
+            if (success)
+                promise->set_value();
+            else
+                reject(*promise, "Write failed");
+        });
+        return promise->get_future();
+    }
+
+#ifdef COMMONS_COROUTINES
+    /**
+     * Adapts a callback based operation to co_await. The coroutine resumes on the thread completing the operation.
+     */
+    template<typename R>
+    class Awaitable {
+    public:
+        using Start = std::function<void(std::function<void(bool, R)>)>;
+
+        explicit Awaitable(Start start) : mStart(std::move(start)) { }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            // the operation may complete right away and resume the coroutine, which destroys this awaitable
+            Start start = std::move(mStart);
+            start([this, handle] (bool success, R result) {
+                mSuccess = success;
+                mResult = std::move(result);
+                handle.resume();
+            });
+        }
+
+        R await_resume() {
+            if (!mSuccess)
+                throw async_connection_error("Operation failed");
+            return std::move(mResult);
+        }
+
+    protected:
+        Start mStart;
+        bool mSuccess = false;
+        R mResult {};
+    };
+
+    /**
+     * co_await conn.asyncConnect();
+     */
+    Awaitable<bool> asyncConnect() {
+        return Awaitable<bool>([this] (std::function<void(bool, bool)> done) {
+            connect([done] (bool success) { done(success, success); });
+        });
+    }
+
+    /**
+     * T pgen = co_await conn.asyncRead<T>();
+     */
+    template<typename T>
+    Awaitable<T> asyncRead() {
+        return Awaitable<T>([this] (std::function<void(bool, T)> done) {
+            readProtoClass<T>([done] (bool success, T &pgen) { done(success, std::move(pgen)); });
+        });
+    }
+
+    /**
+     * co_await conn.asyncWrite(pgen);
+     */
+    template<typename T>
+    Awaitable<bool> asyncWrite(const T &pgen) {
+        Buffer buffer;
+        pgen.serialize(buffer);
+        return Awaitable<bool>([this, buffer] (std::function<void(bool, bool)> done) {
+            enqueueWrite(buffer, [done] (bool success) { done(success, success); });
+        });
+    }
+#endif
+
+    /* Forward everything not I/O related */
+
+    using Connection::connected;
+    using Connection::protocol;
+    using Connection::info;
+    using Connection::stats;
+    using Connection::queued;
+
+protected:
+    class Connector;
+    using Completions = std::vector<std::function<void()>>;
+
+    struct Read {
+        // deserializes from received data: 1 on success, 0 if data is missing, -1 on error
+        std::function<int()> parse;
+        Done done;
+    };
+
+    struct Write {
+        // position of the last byte in the send stream
+        uint64_t end;
+        Done done;
+    };
+
+    template<typename T>
+    static void reject(std::promise<T> &promise, const char *error) {
+        promise.set_exception(std::make_exception_ptr(async_connection_error(error)));
+    }
+
+    void enqueueRead(std::function<int()> parse, Done done);
+    void enqueueWrite(const Buffer &buffer, Done done);
+
+    enum class State {
+        DISCONNECTED,
+        // connect running on a worker, operations are queued
+        CONNECTING,
+        // registered with the event loop
+        CONNECTED
+    };
+
+    /**
+     * Runs on a connect worker: connects and registers with the event loop
+     */
+    bool establish();
+
+    /**
+     * Event loop callback
+     */
+    void onEvent(bool readable, bool writable);
+
+    // the following run with mLock held and collect callbacks to run after unlocking
+    void completeReads(Completions &completions);
+    void completeWrites(Completions &completions);
+    void failAll(Completions &completions);
+    void close(Completions &completions);
+    void updateInterest();
+
+    bool backlogged() {
+        // received data nobody asked for yet
+        return mReads.empty() && mReceive.size() - mReceiveOffset >= READ_AHEAD;
+    }
+
+    static void run(Completions &completions) {
+        for (auto &completion : completions)
+            completion();
+    }
+
+    EventLoop &mLoop;
+
+    // guards all state below and the underlying connection
+    std::mutex mLock;
+    State mState = State::DISCONNECTED;
+    bool mWatchReadable = true, mWatchWritable = false;
+    // pending operations in order
+    std::deque<Read> mReads;
+    std::deque<Write> mWrites;
+    // bytes handed to the send queue so far
+    uint64_t mSendTotal = 0;
+    // data written while connecting
+    Buffer mDeferred;
+
+    // completes once a running connect finished
+    std::shared_future<void> mConnecting;
+};
+
+#endif //COMMONS_ASYNCCONNECTION_H
@@ -20,10 +20,16 @@
 #ifndef COMMONS_CONNECTION_H
 #define COMMONS_CONNECTION_H
 
+#include <chrono>
+#include <istream>
+#include <limits>
+#include <vector>
+
 #include <secure_memory/Buffer.h>
 #include <commons/util/Except.h>
 
 #include <network/ConnectionInfo.h>
+#include <network/ConnectionStats.h>
 #include <network/socket/ISocket.h>
 
 DEFINE_ERROR(connection, base_error);
@@ -37,11 +43,24 @@ public:
 
     Connection(const std::string &host, uint16_t port, bool ssl = true) : Connection(ConnectionInfo(host, port, ssl)) {}
 
+    /**
+     * Adds the remaining traffic to the process-wide counters
+     */
+    ~Connection();
+
     /**
      * Establish a connection
      */
     void connect();
 
+    /**
+     * Establish a connection, bounding the connect by the given timeout instead of the connect timeout of the info
+     *
+     * @param timeoutConnect Connect timeout in milliseconds covering TCP connect and TLS handshake but not resolving,
+     * 0 for none
+     */
+    void connect(uint32_t timeoutConnect);
+
     /**
      * Tries to establish a connection
      *
@@ -49,6 +68,16 @@ public:
      */
     bool tryConnect();
 
+    /**
+     * Tries to establish a connection, bounding the connect by the given timeout instead of the connect timeout of the
+     * info
+     *
+     * @param timeoutConnect Connect timeout in milliseconds covering TCP connect and TLS handshake but not resolving,
+     * 0 for none
+     * @return True on success
+     */
+    bool tryConnect(uint32_t timeoutConnect);
+
     /**
      * Closes the connection if connected
      */
@@ -61,6 +90,15 @@ public:
         return !!mSocket;
     }
 
+    /**
+     * Checks without blocking whether the peer closed the connection. Data received meanwhile is kept for reading.
+     *
+     * @return True if connected and not closed by peer
+     */
+    bool alive() {
+        return receiveNonBlocking() >= 0;
+    }
+
     /**
      * @return IP protocol used for connection
      */
@@ -75,6 +113,13 @@ public:
         return mInfo;
     }
 
+    /**
+     * @return Timings and traffic of the current connection, or of the last one after disconnect
+     */
+    const ConnectionStats &stats() const {
+        return mStats;
+    }
+
     /**
      * @return Underlying socket. Only valid while connected
      */
@@ -83,7 +128,8 @@ public:
     }
 
     /**
-     * Read exactly size bytes from connection into buffer. Blocks while waiting
+     * Read exactly size bytes from connection into buffer. Blocks while waiting.
+     * Data already read ahead by readProtoClass is returned first.
      *
      * @param buffer Buffer receiving the read data
      * @param size Exact count of bytes to read
@@ -92,13 +138,88 @@ public:
     bool read(Buffer &buffer, uint32_t size);
 
     /**
-     * Write buffer to connection
+     * Write buffer to connection. Blocks until all bytes (including previously queued ones) have been written.
      *
      * @param buffer Buffer to write
      * @return True on success
      */
     bool write(const Buffer &buffer);
 
+    /**
+     * Writes as much of buffer as possible without blocking and queues the rest. Queued data is written by following
+     * calls to writeNonBlocking, flush or write.
+     *
+     * @param buffer Buffer to write
+     * @return 1 if everything was written, 0 if data remains queued, -1 if an error/disconnect occurred
+     */
+    int writeNonBlocking(const Buffer &buffer);
+
+    /**
+     * Writes as much queued data as possible without blocking
+     *
+     * @return 1 if the queue is empty, 0 if data remains queued, -1 if an error/disconnect occurred
+     */
+    int flush();
+
+    /**
+     * @return Number of bytes queued by writeNonBlocking
+     */
+    uint32_t queued() const {
+        return mSend.size() - mSendOffset;
+    }
+
+    /**
+     * Sets the backpressure thresholds of the write queue
+     *
+     * @param low Queued bytes below which the connection becomes writable again
+     * @param high Queued bytes above which the connection is no longer writable
+     */
+    void setWatermarks(uint32_t low, uint32_t high) {
+        mLowWatermark = low;
+        mHighWatermark = high;
+        updateBackpressure();
+    }
+
+    /**
+     * Backpressure signal for producers. Becomes false once more than the high watermark is queued and stays false
+     * until the queue drops below the low watermark.
+     *
+     * @return True if producers should continue writing
+     */
+    bool writable() const {
+        return !mBackpressure;
+    }
+
+    /**
+     * Write multiple buffers to connection, gathered into as few socket writes (or TLS records) as possible
+     *
+     * @param buffers Buffers to write in order
+     * @return True if all buffers have been written
+     */
+    bool writeBatch(const std::vector<Buffer> &buffers);
+
+    /**
+     * Sends part of a file without loading it into memory. Plain TCP and kernel TLS connections use sendfile, so the
+     * data is not copied through user space. Otherwise, the file is read and written in bounded chunks.
+     * Blocks until all bytes (including previously queued ones) have been written.
+     *
+     * @param fd File to send from, its file offset is not changed
+     * @param offset Position of the first byte in the file
+     * @param size Number of bytes to send
+     * @return False if the file ended early or an error/disconnect occurred
+     */
+    bool sendFile(int fd, uint64_t offset, uint64_t size);
+
+    /**
+     * Writes the contents of a stream in bounded chunks, without loading it into memory.
+     * Blocks until all bytes (including previously queued ones) have been written.
+     *
+     * @param stream Stream to read from
+     * @param size Number of bytes to write, all until the end of the stream by default
+     * @return False if the stream ended before size bytes or an error/disconnect occurred
+     */
+    bool write(std::istream &stream, uint64_t size = std::numeric_limits<uint64_t>::max());
+
     /**
      * Write a protocol generated class to the connection
      *
@@ -113,35 +234,213 @@ public:
     }
 
     /**
-     * Reads a protocol generated class from the connection
+     * Write multiple protocol generated classes to the connection. The classes are serialized back to back and written
+     * at once, instead of one write per class.
+     *
+     * @param first Iterator to the first class, each needs to have T::serialize(const Buffer&)
+     * @param last Iterator past the last class
+     * @return True on success
+     */
+    template<typename Iterator>
+    bool writeProtoClasses(Iterator first, Iterator last) {
+        Buffer outBuf;
+        for (; first != last; ++first)
+            first->serialize(outBuf);
+        return write(outBuf);
+    }
+
+    /**
+     * Write all protocol generated classes of a container to the connection
+     *
+     * @param pgens Container of classes, each needs to have T::serialize(const Buffer&)
+     * @return True on success
+     */
+    template<typename Container>
+    bool writeProtoClasses(const Container &pgens) {
+        return writeProtoClasses(std::begin(pgens), std::end(pgens));
+    }
+
+    /**
+     * Reads a protocol generated class from the connection. Reads ahead as much data as available, so following
+     * classes can be deserialized without further socket reads.
      *
      * @param pgen the protocol generated class to be read from connection,
-     * must have T::deserialize(const Buffer&, uint32_t &missing)
+     * must have T::deserialize(const uint8_t*, uint32_t size, uint32_t &missing)
      * @return True on success
      */
     template<typename T>
     bool readProtoClass(T &pgen) {
-        Buffer inBuf;
-        uint32_t missing = 0;
-        // try to deserialize, read missing bytes
-        while (!pgen.deserialize(inBuf, missing)) {
-            if (missing == 0) // no bytes missing, but class cannot be deserialized => error
-                return false;
-
-            if (!read(inBuf, missing))
+        int res;
+        // try to deserialize, read ahead if bytes are missing
+        while ((res = parseProtoClass(pgen)) == 0) {
+            if (!receive())
                 return false;
         }
-        return true;
+        return res == 1;
     }
 
 protected:
+    friend class Listener;
+    friend class ConnectionPool;
     using Socket_ref = std::unique_ptr<ISocket>;
 
+    // maximum number of bytes read ahead at once
+    static const uint32_t READ_AHEAD = 64 * 1024;
+    // chunk size of file and stream writes that go through user space
+    static const uint32_t WRITE_CHUNK = 64 * 1024;
+    // traffic accounted per connection before it is added to the process-wide counters
+    static const uint32_t METRICS_BATCH = 64 * 1024;
+
+    /**
+     * Tries to deserialize a protocol generated class from already received data
+     *
+     * @param pgen the protocol generated class to deserialize
+     * @return 1 on success, 0 if data is missing, -1 on error
+     */
+    template<typename T>
+    int parseProtoClass(T &pgen) {
+        auto data = static_cast<const uint8_t*>(mReceive.const_data(mReceiveOffset));
+        uint32_t available = mReceive.size() - mReceiveOffset;
+
+        // the class tells how many bytes it is missing, grow the frame until it is complete
+        uint32_t size = 0, missing = 0;
+        while (!pgen.deserialize(data, size, missing)) {
+            if (missing == 0) // no bytes missing, but class cannot be deserialized => error
+                return -1;
+
+            size += missing;
+            if (size > available) {
+                mReceiveMissing = size - available;
+                return 0;
+            }
+        }
+
+        consumeReceived(size);
+        return 1;
+    }
+
+    /**
+     * Replaces the current connection with an established socket and resets the statistics
+     *
+     * @param socket Connected socket, created with this connection's info
+     * @param resolve Time spent resolving
+     * @param connect Time spent connecting, including the TLS handshake
+     */
+    void established(Socket_ref socket, std::chrono::microseconds resolve, std::chrono::microseconds connect);
+
+    /**
+     * Reads as much data as available into the receive buffer, blocks until at least one byte was received
+     *
+     * @return False on error or disconnect
+     */
+    bool receive();
+
+    /**
+     * Reads as much data as available into the receive buffer and returns immediately
+     *
+     * @return 1 if data was read, 0 if no data was available, -1 if an error/disconnect occurred
+     */
+    int receiveNonBlocking();
+
+    /**
+     * Prepares the receive buffer for the next read
+     *
+     * @return Number of bytes that can be read into the end of the receive buffer
+     */
+    uint32_t reserveReceive();
+
+    /**
+     * Writes data without blocking
+     *
+     * @param data Source memory
+     * @param size Number of bytes to write
+     * @param written Number of bytes written
+     * @return IOStatus::OK if all bytes were written
+     */
+    IOStatus sendNonBlocking(const void *data, uint32_t size, uint32_t &written);
+
+    /**
+     * Writes queued data without blocking
+     *
+     * @return IOStatus::OK if the queue is empty
+     */
+    IOStatus sendQueued();
+
+    /**
+     * Writes queued data, blocks until all bytes have been written
+     *
+     * @return False on error or disconnect
+     */
+    bool writeQueued();
+
+    /**
+     * Writes data, blocks until all bytes have been written. Does not write queued data first.
+     *
+     * @return False on error or disconnect
+     */
+    bool writeAll(const void *data, uint32_t size);
+
+    /**
+     * Updates the backpressure state after the queue changed
+     */
+    void updateBackpressure() {
+        if (queued() > mHighWatermark)
+            mBackpressure = true;
+        else if (queued() < mLowWatermark || queued() == 0)
+            mBackpressure = false;
+    }
+
+    /**
+     * Accounts received bytes, records the time to the first byte
+     *
+     * @param size Number of bytes received, ignored if not positive
+     */
+    void countReceived(ssize_t size);
+
+    /**
+     * Accounts sent bytes
+     *
+     * @param size Number of bytes sent, ignored if not positive
+     */
+    void countSent(ssize_t size);
+
+    /**
+     * Adds traffic not yet published to the process-wide counters. These are shared by all I/O threads, so they are
+     * only updated every METRICS_BATCH bytes and on disconnect.
+     */
+    void publishMetrics();
+
+    /**
+     * Drops bytes from the beginning of the receive buffer
+     *
+     * @param size Number of bytes to drop
+     */
+    void consumeReceived(uint32_t size);
+
     // constant connection information
     ConnectionInfo mInfo;
 
     // current socket
     Socket_ref mSocket;
+
+    // statistics of the current connection
+    ConnectionStats mStats;
+    std::chrono::steady_clock::time_point mEstablished;
+    // traffic not yet added to the process-wide counters
+    uint64_t mUnpublishedIn = 0, mUnpublishedOut = 0;
+
+    // received but not yet consumed data, starting at mReceiveOffset
+    Buffer mReceive;
+    uint32_t mReceiveOffset = 0;
+    // bytes missing to complete the pending class
+    uint32_t mReceiveMissing = 0;
+
+    // queued but not yet written data, starting at mSendOffset
+    Buffer mSend;
+    uint32_t mSendOffset = 0;
+    // backpressure thresholds and state
+    uint32_t mLowWatermark = 256 * 1024, mHighWatermark = 1024 * 1024;
+    bool mBackpressure = false;
 };
 
 #endif //COMMONS_CONNECTION_H
@@ -22,6 +22,56 @@
 
 #include <network/ssl/CertStore.h>
 
+/**
+ * Tuning options applied to the TCP socket before connecting. Zero values keep the system default, options not
+ * available on a platform are ignored.
+ */
+struct SocketOptions {
+    /**
+     * Disables Nagle's algorithm (TCP_NODELAY), so small frames are sent without delay
+     */
+    bool noDelay = false;
+    /**
+     * Send buffer size in bytes (SO_SNDBUF)
+     */
+    uint32_t sendBuffer = 0;
+    /**
+     * Receive buffer size in bytes (SO_RCVBUF)
+     */
+    uint32_t receiveBuffer = 0;
+    /**
+     * Enables TCP keepalive (SO_KEEPALIVE)
+     */
+    bool keepAlive = false;
+    /**
+     * Idle time in seconds before the first keepalive probe (TCP_KEEPIDLE)
+     */
+    uint32_t keepAliveIdle = 0;
+    /**
+     * Interval in seconds between keepalive probes (TCP_KEEPINTVL)
+     */
+    uint32_t keepAliveInterval = 0;
+    /**
+     * Unanswered keepalive probes until the connection is dropped (TCP_KEEPCNT)
+     */
+    uint32_t keepAliveCount = 0;
+    /**
+     * Time in milliseconds sent data may remain unacknowledged before the connection is dropped (TCP_USER_TIMEOUT,
+     * Linux only)
+     */
+    uint32_t userTimeout = 0;
+    /**
+     * Time in microseconds to busy poll the device queue on blocking reads (SO_BUSY_POLL, Linux only)
+     */
+    uint32_t busyPoll = 0;
+    /**
+     * Acknowledges received data immediately instead of delaying ACKs (TCP_QUICKACK, Linux only). The kernel clears
+     * it on its own, so it is set again after each read that returned data. This costs one setsockopt call per such
+     * read, only enable it for request/response traffic where delayed ACKs add latency.
+     */
+    bool quickAck = false;
+};
+
 class ConnectionInfo {
 public:
     ConnectionInfo(std::string host, uint16_t port, bool ssl = true, bool sslVerify = true, std::string certPath = "",
@@ -65,6 +115,32 @@ public:
         return mCertStore;
     }
 
+    /**
+     * Opt-in kernel TLS offload (Linux, OpenSSL 3). After the handshake the kernel encrypts outgoing records, so
+     * bulk data is sent without copying through OpenSSL. Falls back to user space encryption if the kernel or the
+     * negotiated cipher does not support it.
+     *
+     * @param value True to enable
+     */
+    void setKernelTLS(bool value) {
+        mKernelTLS = value;
+    }
+
+    bool kernelTLS() const {
+        return mKernelTLS;
+    }
+
+    /**
+     * @param options Tuning options for the TCP socket
+     */
+    void setSocketOptions(const SocketOptions &options) {
+        mSocketOptions = options;
+    }
+
+    const SocketOptions &socketOptions() const {
+        return mSocketOptions;
+    }
+
     size_t hash() const {
         return (std::hash<std::string>()(mHost) + 0x9e3779b9) ^ std::hash<uint16_t>()(mPort);
     }
@@ -79,10 +155,14 @@ private:
     bool mSSLVerify;
     std::string mCertPath;
     CertStore &mCertStore;
+    bool mKernelTLS = false;
 
     // timeouts
     uint32_t mTimeoutConnect;
     uint32_t mTimeoutIO;
+
+    // socket tuning
+    SocketOptions mSocketOptions;
 };
 
 #endif //COMMONS_CONNECTIONINFO_H
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMONS_CONNECTIONPOOL_H
+#define COMMONS_CONNECTIONPOOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <network/Connection.h>
+
+DEFINE_ERROR(connection_pool, connection_error);
+
+/**
+ * Pool of established connections, keyed by host, port and security settings. Connections are handed out as leases
+ * and return to the pool when the lease ends.
+ */
+class ConnectionPool {
+    using Connection_ref = std::unique_ptr<Connection>;
+    using Clock = std::chrono::steady_clock;
+public:
+    /**
+     * Liveness probe for idle connections
+     *
+     * @param conn Idle connection
+     * @return True if the connection can be reused
+     */
+    using Probe = std::function<bool(Connection &conn)>;
+
+    /**
+     * Pool counters
+     */
+    struct Stats {
+        /**
+         * Acquires served by an idle connection
+         */
+        uint64_t hits = 0;
+        /**
+         * Acquires that had to establish a new connection
+         */
+        uint64_t misses = 0;
+        /**
+         * Idle connections dropped because they expired, failed the probe or exceeded the per-host limit
+         */
+        uint64_t evictions = 0;
+        /**
+         * Idle connections currently held
+         */
+        uint64_t idle = 0;
+    };
+
+    /**
+     * Exclusive use of a pooled connection. Returns the connection to the pool on destruction.
+     */
+    class Lease {
+    public:
+        Lease(Lease &&other) noexcept : mPool(other.mPool), mConn(std::move(other.mConn)), mReuse(other.mReuse) { }
+        Lease(const Lease &) = delete;
+
+        ~Lease() {
+            release();
+        }
+
+        Connection &operator*() {
+            return *mConn;
+        }
+
+        Connection *operator->() {
+            return mConn.get();
+        }
+
+        /**
+         * Prevents the connection from being reused, e.g. after a protocol error
+         */
+        void invalidate() {
+            mReuse = false;
+        }
+
+        /**
+         * Returns the connection to the pool early
+         */
+        void release() {
+            if (mConn)
+                mPool->release(std::move(mConn), mReuse);
+        }
+
+    protected:
+        friend class ConnectionPool;
+
+        Lease(ConnectionPool *pool, Connection_ref conn) : mPool(pool), mConn(std::move(conn)) { }
+
+        ConnectionPool *mPool;
+        Connection_ref mConn;
+        bool mReuse = true;
+    };
+
+    /**
+     * Creates an empty pool
+     *
+     * @param maxIdleTime Idle connections older than this are evicted
+     * @param maxIdlePerHost Maximum number of idle connections kept per host
+     */
+    explicit ConnectionPool(std::chrono::milliseconds maxIdleTime = std::chrono::seconds(60),
+                            uint32_t maxIdlePerHost = 8)
+            : mMaxIdleTime(maxIdleTime), mMaxIdlePerHost(maxIdlePerHost) { }
+
+    /**
+     * Stops maintenance. All leases must have ended before.
+     */
+    ~ConnectionPool();
+
+    /**
+     * Hands out an idle connection to the host or establishes a new one
+     *
+     * @param info Connection information
+     * @return Lease of an established connection
+     */
+    Lease acquire(const ConnectionInfo &info);
+
+    /**
+     * Keeps at least count idle connections to the host, established by maintain()
+     *
+     * @param info Connection information
+     * @param count Minimum number of idle connections
+     */
+    void setMinIdle(const ConnectionInfo &info, uint32_t count);
+
+    /**
+     * Sets the probe used on idle connections by acquire() and maintain(). Defaults to Connection::alive().
+     *
+     * @param probe Liveness probe
+     */
+    void setProbe(Probe probe);
+
+    /**
+     * Probe that sends a HeartBeat and expects the peer to answer with a HeartBeat of the same sequence number
+     *
+     * @param timeout Time to wait for the answer, a silent peer fails the probe
+     * @return Liveness probe
+     */
+    static Probe heartBeatProbe(std::chrono::milliseconds timeout = std::chrono::milliseconds(1000));
+
+    /**
+     * Evicts expired and dead idle connections, then establishes connections up to the minimum per host
+     */
+    void maintain();
+
+    /**
+     * Runs maintain() periodically in a background thread until the pool is destroyed
+     *
+     * @param interval Time between maintenance runs
+     */
+    void startMaintenance(std::chrono::milliseconds interval);
+
+    /**
+     * @return Current pool counters
+     */
+    Stats stats();
+
+protected:
+    struct Idle {
+        Connection_ref conn;
+        Clock::time_point since;
+    };
+
+    struct Host {
+        std::deque<Idle> idle;
+        // information for establishing warm connections
+        std::unique_ptr<ConnectionInfo> info;
+        uint32_t minIdle = 0;
+    };
+
+    /**
+     * Identifies interchangeable connections. A connection verified less strictly must never be leased to a caller
+     * requiring verification, so the security settings are part of the key.
+     */
+    struct Key {
+        explicit Key(const ConnectionInfo &info) : host(info.host()), port(info.port()), ssl(info.ssl()),
+                sslVerify(info.sslVerify()), certPath(info.certPath()), certStore(&info.certStore()) { }
+
+        bool operator==(const Key &other) const {
+            return host == other.host && port == other.port && ssl == other.ssl && sslVerify == other.sslVerify
+                   && certPath == other.certPath && certStore == other.certStore;
+        }
+
+        std::string host;
+        uint16_t port;
+        bool ssl, sslVerify;
+        std::string certPath;
+        const CertStore *certStore;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            size_t hash = (std::hash<std::string>()(key.host) + 0x9e3779b9) ^ std::hash<uint16_t>()(key.port);
+            hash ^= std::hash<std::string>()(key.certPath) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+            hash ^= std::hash<const CertStore*>()(key.certStore) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+            return hash ^ (static_cast<size_t>(key.ssl) << 1 | static_cast<size_t>(key.sslVerify));
+        }
+    };
+
+    void release(Connection_ref conn, bool reuse);
+    bool probe(Connection &conn);
+
+    // configuration
+    std::chrono::milliseconds mMaxIdleTime;
+    uint32_t mMaxIdlePerHost;
+    Probe mProbe;
+
+    // lock for hosts, probe and counters
+    std::mutex mLock;
+    // hosts by connection settings
+    std::unordered_map<Key, Host, KeyHash> mHosts;
+    Stats mStats;
+
+    // background maintenance
+    std::thread mMaintenance;
+    std::condition_variable mStopCondition;
+    bool mStopping = false;
+};
+
+#endif //COMMONS_CONNECTIONPOOL_H
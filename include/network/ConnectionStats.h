@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMONS_CONNECTIONSTATS_H
+#define COMMONS_CONNECTIONSTATS_H
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * Timings and traffic of a single connection
+ */
+struct ConnectionStats {
+    /**
+     * Time spent resolving the host name
+     */
+    std::chrono::microseconds resolve {0};
+    /**
+     * Time spent establishing the TCP connection, including racing multiple addresses
+     */
+    std::chrono::microseconds connect {0};
+    /**
+     * Time spent in the TLS handshake, zero for plain TCP
+     */
+    std::chrono::microseconds handshake {0};
+    /**
+     * Time from the established connection to the first received byte, zero until a byte was received
+     */
+    std::chrono::microseconds firstByte {0};
+    /**
+     * True if the TLS session was resumed
+     */
+    bool resumed = false;
+    /**
+     * Bytes received
+     */
+    uint64_t bytesIn = 0;
+    /**
+     * Bytes sent
+     */
+    uint64_t bytesOut = 0;
+};
+
+/**
+ * Reconnects of a supervised PushConnection
+ */
+struct ReconnectStats {
+    /**
+     * Successful reconnects
+     */
+    uint32_t reconnects = 0;
+    /**
+     * Failed reconnect attempts, including dropped by the resubscribe hook
+     */
+    uint32_t failedAttempts = 0;
+    /**
+     * Time from the last drop to the last successful reconnect
+     */
+    std::chrono::microseconds lastDowntime {0};
+    /**
+     * Time spent disconnected over all reconnects
+     */
+    std::chrono::microseconds totalDowntime {0};
+};
+
+/**
+ * Process-wide counters of all connections
+ */
+struct NetworkStats {
+    /**
+     * Established outgoing connections
+     */
+    uint64_t connects = 0;
+    /**
+     * Accepted incoming connections
+     */
+    uint64_t accepts = 0;
+    /**
+     * Completed TLS handshakes, client and server side
+     */
+    uint64_t handshakes = 0;
+    /**
+     * TLS handshakes that resumed a session
+     */
+    uint64_t resumptions = 0;
+    /**
+     * TLS handshakes that failed certificate verification
+     */
+    uint64_t verificationFailures = 0;
+    /**
+     * Bytes received. Open connections add their traffic in batches of 64 KiB, the rest once they disconnect.
+     */
+    uint64_t bytesIn = 0;
+    /**
+     * Bytes sent. Open connections add their traffic in batches of 64 KiB, the rest once they disconnect.
+     */
+    uint64_t bytesOut = 0;
+    /**
+     * Successful reconnects of supervised connections
+     */
+    uint64_t reconnects = 0;
+    /**
+     * Time supervised connections spent disconnected until they were restored, in microseconds
+     */
+    uint64_t downtime = 0;
+
+    /**
+     * @return Current values of all counters. Counters are read one by one, not as an atomic snapshot.
+     */
+    static NetworkStats snapshot();
+};
+
+#endif //COMMONS_CONNECTIONSTATS_H
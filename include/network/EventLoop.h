@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMONS_EVENTLOOP_H
+#define COMMONS_EVENTLOOP_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <network/PushConnection.h>
+
+DEFINE_ERROR(event_loop, base_error);
+
+/**
+ * Reactor driving many connections from a small pool of threads. Backed by epoll, only available on Linux.
+ *
+ * Each registered descriptor is dispatched to at most one thread at a time (one-shot semantics), so callbacks of the
+ * same connection never run concurrently. Events are level-triggered: if data remains in the socket after the callback
+ * returned, the callback is invoked again.
+ */
+class EventLoop {
+public:
+    /**
+     * Called on socket events. EOF and errors are reported as readable.
+     * Read until no more data is available, since data already buffered by TLS does not trigger further events.
+     *
+     * @param readable True if the socket is readable
+     * @param writable True if the socket is writable
+     */
+    using Callback = std::function<void(bool readable, bool writable)>;
+
+    /**
+     * Called if a notify was triggered. The callback has to clear the notify, otherwise it fires again.
+     */
+    using NotifyCallback = std::function<void()>;
+
+    /**
+     * Creates the event loop
+     *
+     * @param threads Number of dispatching threads started by start()
+     */
+    explicit EventLoop(uint32_t threads = 1);
+
+    /**
+     * Stops all dispatching threads
+     */
+    ~EventLoop();
+
+    /**
+     * Registers an established connection
+     *
+     * @param conn Connection to watch, must outlive its registration
+     * @param callback Invoked on socket events
+     * @param writable True to also watch for writability
+     */
+    void add(Connection &conn, Callback callback, bool writable = false);
+
+    /**
+     * Registers an established push connection and its notify
+     *
+     * @param conn Connection to watch, must outlive its registration
+     * @param callback Invoked on socket events
+     * @param notify Invoked if a notify was triggered
+     */
+    void add(PushConnection &conn, Callback callback, NotifyCallback notify);
+
+    /**
+     * Changes whether writability is watched
+     *
+     * @param conn Registered connection
+     * @param writable True to watch for writability
+     */
+    void setWritable(Connection &conn, bool writable);
+    void setWritable(PushConnection &conn, bool writable);
+
+    /**
+     * Changes whether readability is watched, e.g. to stop reading while enough data is buffered. EOF and errors are
+     * reported regardless.
+     *
+     * @param conn Registered connection
+     * @param readable True to watch for readability
+     */
+    void setReadable(Connection &conn, bool readable);
+    void setReadable(PushConnection &conn, bool readable);
+
+    /**
+     * Unregisters a connection. Waits for a running callback of this connection to return, unless called from it.
+     *
+     * @param conn Registered connection
+     */
+    void remove(Connection &conn);
+    void remove(PushConnection &conn);
+
+    /**
+     * Starts the dispatching threads
+     */
+    void start();
+
+    /**
+     * Stops and joins the dispatching threads. Registrations are kept.
+     */
+    void stop();
+
+protected:
+    struct Handler {
+        int fd;
+        uint32_t events;
+        Callback callback;
+        // held while the callback runs
+        std::mutex running;
+        // set under running once unregistered, a thread that fetched the handler before must not call it anymore
+        bool removed = false;
+    };
+    using Handler_ref = std::shared_ptr<Handler>;
+
+    void addFd(int fd, uint32_t events, Callback callback);
+    void modifyFd(int fd, uint32_t events, bool watch);
+    void removeFd(int fd);
+    Handler_ref findFd(int fd);
+
+    void run();
+    void dispatch(const Handler_ref &handler, uint32_t events);
+
+    // epoll instance and wake up descriptor used by stop()
+    int mPoll = -1, mWake = -1;
+    uint32_t mThreadCount;
+    std::vector<std::thread> mThreads;
+    std::atomic<bool> mStopping;
+
+    // lock for the handler map
+    std::mutex mLock;
+    // registered handlers by descriptor
+    std::unordered_map<int, Handler_ref> mHandlers;
+};
+
+#endif //COMMONS_EVENTLOOP_H
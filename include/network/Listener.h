@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMONS_LISTENER_H
+#define COMMONS_LISTENER_H
+
+#include <atomic>
+#include <memory>
+
+#include <network/Connection.h>
+
+DEFINE_ERROR(listener, connection_error);
+
+class TCPSocket;
+class SSLContext;
+
+/**
+ * Platform independent TCP/SSL server. Accepted connections are regular Connections, so framing, protocol classes and
+ * statistics work the same on both ends.
+ *
+ * accept() may be called from multiple threads. Alternatively, several Listeners with reuse port enabled can bind the
+ * same port, one per acceptor thread, and the kernel balances incoming connections between them. Servers facing
+ * untrusted clients accept with acceptPending() and run handshake() on a worker thread, so a client stalling its
+ * handshake does not hold up other accepts.
+ */
+class Listener {
+public:
+    /**
+     * @param info Local address and port to bind (e.g. "0.0.0.0", "::" or "127.0.0.1", port 0 for any). SSL, IO timeout
+     * and socket options apply to accepted connections.
+     * @param certChain PEM file containing the certificate chain, required for SSL
+     * @param privateKey PEM file containing the private key, required for SSL
+     */
+    explicit Listener(ConnectionInfo info, std::string certChain = "", std::string privateKey = "");
+    ~Listener();
+
+    /**
+     * Allows other sockets to bind the same port (SO_REUSEPORT), must be set before listen. Ignored on platforms
+     * without support.
+     *
+     * @param value True to enable
+     */
+    void setReusePort(bool value) {
+        mReusePort = value;
+    }
+
+    /**
+     * Binds the local address and starts listening
+     *
+     * @param backlog Maximum number of pending connections
+     */
+    void listen(int backlog = 128);
+
+    /**
+     * Waits for the next incoming connection and completes its TLS handshake on the calling thread. Connections failing
+     * the handshake are dropped and the next one is awaited. The handshake blocks further accepts of this thread for
+     * up to its timeout, see acceptPending() to avoid that.
+     *
+     * @return Established connection, nullptr if the listener was closed or failed
+     */
+    std::unique_ptr<Connection> accept();
+
+    /**
+     * Waits for the next incoming connection without running the TLS handshake. The connection must be passed to
+     * handshake() before it is used.
+     *
+     * @return Accepted connection, nullptr if the listener was closed or failed
+     */
+    std::unique_ptr<Connection> acceptPending();
+
+    /**
+     * Completes the TLS handshake of a connection returned by acceptPending(), a no-op for plain TCP. Fails if the
+     * handshake is not completed within the IO timeout (HANDSHAKE_TIMEOUT if none is set). May be called from any
+     * thread.
+     *
+     * @param conn Pending connection, disconnected on failure
+     * @return True if the connection is established
+     */
+    bool handshake(Connection &conn);
+
+    /**
+     * Stops accepting, wakes up threads blocked in accept
+     */
+    void close();
+
+    /**
+     * @return Bound port, useful if port 0 was requested. Only valid after listen
+     */
+    uint16_t port() const {
+        return mPort;
+    }
+
+    /**
+     * @return Local address and settings for accepted connections
+     */
+    const ConnectionInfo &info() const {
+        return mInfo;
+    }
+
+    // handshake timeout in milliseconds if the IO timeout is not set
+    static const uint32_t HANDSHAKE_TIMEOUT = 10 * 1000;
+
+protected:
+    // local address and settings for accepted connections
+    ConnectionInfo mInfo;
+    std::string mCertChain, mPrivateKey;
+    bool mReusePort = false;
+
+    // listening socket
+    std::unique_ptr<TCPSocket> mSocket;
+    uint16_t mPort = 0;
+    std::atomic<bool> mClosed {false};
+    // server context if SSL is enabled
+    SSLContext *mContext = nullptr;
+};
+
+#endif //COMMONS_LISTENER_H
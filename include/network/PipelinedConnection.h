@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMONS_PIPELINEDCONNECTION_H
+#define COMMONS_PIPELINEDCONNECTION_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+
+#include <commons/log/Log.h>
+#include <network/AsyncConnection.h>
+
+DEFINE_ERROR(pipelined_connection, async_connection_error);
+
+/**
+ * Pipelined request/response client. Requests are tagged with an id and written without waiting for earlier responses,
+ * so many requests per round trip share one connection and TLS session. Responses are matched back to their request by
+ * id and may arrive in any order. Untagged responses (id 0, e.g. from peers not supporting pipelining) answer the
+ * oldest pending request.
+ *
+ * The number of requests in flight is bounded by a window, request() blocks while it is full. A response that fails
+ * to parse breaks the pipeline: the connection is closed and requests fail until the next connect(). All methods are
+ * thread-safe.
+ *
+ * @tparam Request Protocol generated request class, needs requestId(uint32_t) (e.g. Header)
+ * @tparam Response Protocol generated response class, needs uint32_t requestId() (e.g. Response)
+ */
+template<typename Request, typename Response>
+class PipelinedConnection {
+public:
+    /**
+     * @param loop Event loop driving the connection, must outlive it
+     * @param info Connection information
+     * @param window Maximum number of requests in flight
+     */
+    PipelinedConnection(EventLoop &loop, ConnectionInfo info, uint32_t window = 64)
+            : mWindow(window > 0 ? window : 1), mConnection(loop, std::move(info)) { }
+
+    /**
+     * Waits for a running connect, then disconnects. Pending requests fail.
+     */
+    ~PipelinedConnection() {
+        // our connect callback still uses this after the connection finished connecting
+        if (mConnected.valid())
+            mConnected.wait();
+        mConnection.disconnect();
+    }
+
+    /**
+     * Establishes the connection and starts receiving responses
+     *
+     * @return Future that is ready once connected, holds pipelined_connection_error on failure
+     */
+    std::future<void> connect() {
+        auto connected = std::make_shared<std::promise<void>>();
+        mConnected = connected->get_future().share();
+        {
+            std::lock_guard<std::mutex> guard(mLock);
+            mBroken = false;
+        }
+
+        auto promise = std::make_shared<std::promise<void>>();
+        mConnection.connect([this, connected, promise] (bool success) {
+            if (success)
+                receive();
+            connected->set_value();
+
+            // from here on, this may be destroyed
+            if (success)
+                promise->set_value();
+            else
+                promise->set_exception(std::make_exception_ptr(pipelined_connection_error("Connect failed")));
+        });
+        return promise->get_future();
+    }
+
+    /**
+     * Closes the connection. Pending requests fail.
+     */
+    void disconnect() {
+        mConnection.disconnect();
+    }
+
+    /**
+     * Tags and sends a request. Blocks while the window is full.
+     *
+     * @param request Request to send, its requestId is overwritten
+     * @return Future of the matching response, holds pipelined_connection_error if the request could not be sent or
+     * the connection was closed before the response arrived
+     */
+    std::future<Response> request(Request request) {
+        // requests are written in id order, so untagged responses can be matched in order
+        std::lock_guard<std::mutex> writeGuard(mWriteLock);
+        std::future<Response> future;
+        uint32_t id;
+        {
+            std::unique_lock<std::mutex> guard(mLock);
+            mSlotFree.wait(guard, [this] () { return mBroken || mPending.size() < mWindow; });
+
+            if (mBroken) {
+                std::promise<Response> promise;
+                promise.set_exception(std::make_exception_ptr(closed()));
+                return promise.get_future();
+            }
+
+            id = nextId();
+            future = mPending[id].get_future();
+            mOrder.push_back(id);
+        }
+
+        request.requestId(id);
+        mConnection.writeProtoClass(request, [this, id] (bool success) {
+            if (!success)
+                fail(id);
+        });
+        return future;
+    }
+
+    /**
+     * @return True if connected
+     */
+    bool connected() const {
+        return mConnection.connected();
+    }
+
+    /**
+     * @return Number of requests waiting for their response
+     */
+    uint32_t inFlight() {
+        std::lock_guard<std::mutex> guard(mLock);
+        return static_cast<uint32_t>(mPending.size());
+    }
+
+    /**
+     * @return Maximum number of requests in flight
+     */
+    uint32_t window() const {
+        return mWindow;
+    }
+
+    /**
+     * @return Statistics of the underlying connection
+     */
+    const ConnectionStats &stats() const {
+        return mConnection.stats();
+    }
+
+protected:
+    static pipelined_connection_error closed() {
+        return pipelined_connection_error("Connection closed before response");
+    }
+
+    // with mLock held
+    uint32_t nextId() {
+        // 0 means untagged, ids of requests still in flight are not reused after wrapping
+        do {
+            mNextId++;
+        } while (mNextId == 0 || mPending.count(mNextId) > 0);
+        return mNextId;
+    }
+
+    /**
+     * Keeps exactly one response read pending while connected
+     */
+    void receive() {
+        mConnection.readProtoClass<Response>([this] (bool success, Response &response) {
+            // closed, or a malformed response left the stream at an unknown position
+            if (!success) {
+                failAll();
+                return;
+            }
+
+            complete(response);
+            receive();
+        });
+    }
+
+    void complete(Response &response) {
+        std::promise<Response> promise;
+        {
+            std::lock_guard<std::mutex> guard(mLock);
+
+            uint32_t id = response.requestId();
+            if (id == 0) {
+                // untagged: answers the oldest request still pending
+                prune();
+                if (!mOrder.empty())
+                    id = mOrder.front();
+            }
+
+            auto elem = mPending.find(id);
+            if (elem == mPending.end()) {
+                Log::warn << "PipelinedConnection: dropping response to unknown request " << id;
+                return;
+            }
+
+            promise = std::move(elem->second);
+            mPending.erase(elem);
+            prune();
+        }
+
+        mSlotFree.notify_one();
+        promise.set_value(std::move(response));
+    }
+
+    void fail(uint32_t id) {
+        std::promise<Response> promise;
+        {
+            std::lock_guard<std::mutex> guard(mLock);
+
+            // the response may have arrived already
+            auto elem = mPending.find(id);
+            if (elem == mPending.end())
+                return;
+
+            promise = std::move(elem->second);
+            mPending.erase(elem);
+            prune();
+        }
+
+        mSlotFree.notify_one();
+        promise.set_exception(std::make_exception_ptr(closed()));
+    }
+
+    void failAll() {
+        std::unordered_map<uint32_t, std::promise<Response>> pending;
+        {
+            std::lock_guard<std::mutex> guard(mLock);
+            mBroken = true;
+            pending.swap(mPending);
+            mOrder.clear();
+        }
+
+        // no read is pending anymore, so nothing sent from here on could be answered. Writes still in flight fail.
+        mConnection.disconnect();
+
+        mSlotFree.notify_all();
+        for (auto &elem : pending)
+            elem.second.set_exception(std::make_exception_ptr(closed()));
+    }
+
+    // with mLock held: drops answered ids from the request order
+    void prune() {
+        while (!mOrder.empty() && mPending.count(mOrder.front()) == 0)
+            mOrder.pop_front();
+
+        // responses answered out of order leave gaps behind a slow request, compact them
+        if (mOrder.size() > 2 * mWindow)
+            mOrder.erase(std::remove_if(mOrder.begin(), mOrder.end(), [this] (uint32_t id) {
+                return mPending.count(id) == 0;
+            }), mOrder.end());
+    }
+
+    const uint32_t mWindow;
+
+    // serializes writers, so ids go out in order
+    std::mutex mWriteLock;
+    // guards the state below
+    std::mutex mLock;
+    std::condition_variable mSlotFree;
+    uint32_t mNextId = 0;
+    // set once responses can no longer be received, until the next connect
+    bool mBroken = false;
+    // requests in flight by id, and their ids in send order
+    std::unordered_map<uint32_t, std::promise<Response>> mPending;
+    std::deque<uint32_t> mOrder;
+
+    // completes once our connect callback finished
+    std::shared_future<void> mConnected;
+
+    // last member: destroyed first, so its failing callbacks still find the state above
+    AsyncConnection mConnection;
+};
+
+#endif //COMMONS_PIPELINEDCONNECTION_H
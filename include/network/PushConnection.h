@@ -20,27 +20,89 @@
 #ifndef COMMONS_PUSHCONNECTION_H
 #define COMMONS_PUSHCONNECTION_H
 
+#include <chrono>
+#include <functional>
+
 #include <network/Connection.h>
 
 DEFINE_ERROR(async_connection, connection_error);
 
+class NotifySocket;
+
+/**
+ * Backoff between reconnect attempts of a supervised PushConnection. The delay before attempt n is drawn uniformly
+ * from [0, min(maxDelay, initialDelay * factor^n)], so clients dropped at the same moment spread their reconnects.
+ */
+struct ReconnectPolicy {
+    std::chrono::milliseconds initialDelay {100};
+    std::chrono::milliseconds maxDelay {30000};
+    double factor = 2;
+    /**
+     * Consecutive failed attempts after which waitReadable gives up, 0 to retry forever
+     */
+    uint32_t maxAttempts = 0;
+};
+
 /**
  * Platform independent TCP/SSL client with non-blocking read and wait support
  */
 class PushConnection : Connection {
 public:
-    explicit PushConnection(const ConnectionInfo &info) : Connection(info) {
-        // create notify socket
-        clearAll();
+    /**
+     * Called after each reconnect before waiting continues, e.g. to replay subscriptions
+     *
+     * @return False to drop the connection again, the next attempt follows after backoff
+     */
+    using ResubscribeHook = std::function<bool(PushConnection &conn)>;
+
+    explicit PushConnection(const ConnectionInfo &info);
+    ~PushConnection();
+
+    /**
+     * Enables supervised mode: once the connection drops, reads report no data (0) instead of an error, and the next
+     * waitReadable reconnects with backoff before it continues waiting. Notifies interrupt the backoff, connecting
+     * itself is bounded by the connect timeout and the remaining timeout of waitReadable; a call without time left
+     * makes no attempt. The TLS handshake counts towards connecting, resolving is only bounded by its own timeout. TLS
+     * sessions are resumed from the session cache, so reconnects after short outages are cheap.
+     *
+     * @param policy Backoff between attempts, reschedules a pending attempt
+     * @param resubscribe Called after each reconnect
+     */
+    void supervise(ReconnectPolicy policy, ResubscribeHook resubscribe = nullptr) {
+        mPolicy = policy;
+        mResubscribe = std::move(resubscribe);
+        mSupervised = true;
+
+        if (mLost) {
+            mAttempts = 0;
+            backoff();
+        }
+    }
+
+    /**
+     * @return Reconnect statistics of this connection
+     */
+    const ReconnectStats &reconnectStats() const {
+        return mReconnectStats;
+    }
+
+    /**
+     * Closes the connection, a supervised connection is not restored afterwards
+     */
+    void disconnect() {
+        mLost = false;
+        Connection::disconnect();
     }
 
     /**
      * Sends one notify to the queue. This should be used to wake up the waiting thread.
+     * On Linux, notifies are coalesced, so any number of producers cost the waiting thread a single wake up.
      */
     void notify();
 
     /**
-     * Clears one notify from the queue. Don't attempt to clear more notifies than available.
+     * Clears one notify from the queue, or all of them where notifies are coalesced. Does nothing if no notify is
+     * pending.
      */
     void clear();
 
@@ -61,55 +123,136 @@ public:
     bool waitReadable(bool &readable, bool &notify);
 
     /**
-     * Reads from the socket and returns immediately.
+     * Block until raw data is available, a notify is triggered or the timeout expired.
+     * Note: EOF is also reported as readable
+     *
+     * @param readable True if data is available
+     * @param notify True if notify was triggered
+     * @param timeout Maximum time to wait
+     * @return 1 if readable or notified, 0 if the timeout expired, -1 on error
+     */
+    int waitReadable(bool &readable, bool &notify, std::chrono::milliseconds timeout);
+
+    /**
+     * Block until raw data is available, a notify is triggered or the deadline passed.
+     * Note: EOF is also reported as readable
+     *
+     * @param readable True if data is available
+     * @param notify True if notify was triggered
+     * @param deadline Point in time to stop waiting at
+     * @return 1 if readable or notified, 0 if the deadline passed, -1 on error
+     */
+    int waitReadable(bool &readable, bool &notify, std::chrono::steady_clock::time_point deadline);
+
+    /**
+     * Reads from the socket and returns immediately. Partially received data (including incomplete TLS records) is
+     * kept until the next call.
      * Note: waitReadable does not guarantee that any application data will actually be available.
      *
      * @param buffer Target buffer (can be reused from previous readNonBlocking)
      * @param size Maximum number of bytes to read
-     * @return 1 if data was read, 0 if no data was available, -1 if an error/disconnect occurred
+     * @return 1 if data was read, 0 if no data was available (or the supervised connection dropped), -1 if an
+     * error/disconnect occurred
      */
     int readNonBlocking(Buffer &buffer, uint32_t size);
 
     /**
-     * Reads a protocol generated class from the connection
+     * Reads a protocol generated class from the connection without blocking. Reads ahead as much data as available,
+     * so call it until it returns 0 to consume all received classes.
      *
-     * @param buffer Reusable target buffer.
      * @param pgen the protocol generated class to be read from connection,
-     * must have T::deserialize(const Buffer&, uint32_t &missing)
-     * @return True on success
+     * must have T::deserialize(const uint8_t*, uint32_t size, uint32_t &missing)
+     * @return 1 if a class was read, 0 if not enough data was available (or the supervised connection dropped), -1
+     * if an error/disconnect occurred
      */
     template <typename T>
-    int readProtoClass(Buffer &buffer, T& pgen) {
-        // try to deserialize, read missing bytes
-        uint32_t missing = 0;
-        while (!pgen.deserialize(buffer, missing)) {
-            if (missing == 0) // no bytes missing, but class cannot be deserialized => error
-                return -1;
-
-            int read = readNonBlocking(buffer, missing);
-            if (read <= 0)
-                return read;
+    int readProtoClass(T& pgen) {
+        int res;
+        // try to deserialize, read ahead if bytes are missing
+        while ((res = parseProtoClass(pgen)) == 0) {
+            int read = receiveNonBlocking();
+            if (read < 0)
+                return dropped();
+            if (read == 0)
+                return 0;
         }
+        return res;
+    }
 
-        buffer.clear();
-        return 1;
+    /**
+     * Reads a protocol generated class from the connection without blocking
+     *
+     * @deprecated Partial data is kept by the connection, buffer is unused
+     */
+    template <typename T>
+    int readProtoClass(Buffer &, T& pgen) {
+        return readProtoClass(pgen);
     }
 
     /* Forward everything not read related */
 
     using Connection::connect;
     using Connection::tryConnect;
-    using Connection::disconnect;
     using Connection::connected;
+    using Connection::alive;
     using Connection::protocol;
     using Connection::info;
+    using Connection::stats;
     using Connection::socket;
     using Connection::write;
+    using Connection::writeNonBlocking;
+    using Connection::flush;
+    using Connection::queued;
+    using Connection::setWatermarks;
+    using Connection::writable;
+    using Connection::writeBatch;
+    using Connection::sendFile;
     using Connection::writeProtoClass;
+    using Connection::writeProtoClasses;
 
 protected:
+    friend class EventLoop;
+
+    /**
+     * Polls the socket and the notify once
+     *
+     * @param timeout Timeout in milliseconds, -1 to wait indefinitely
+     * @return Positive if readable or notified, 0 on timeout, negative on error
+     */
+    int pollReadable(bool &readable, bool &notify, int timeout);
+
+    /**
+     * Called once a read found the connection closed
+     *
+     * @return 0 if supervised (the connection is restored by the next wait), -1 otherwise
+     */
+    int dropped();
+
+    /**
+     * Reconnects a dropped supervised connection, waiting for backoff between attempts
+     *
+     * @param notify Set if a notify interrupted the backoff
+     * @param timeout Timeout in milliseconds, -1 to wait indefinitely. Reduced by the time spent.
+     * @return 1 if reconnected, 0 if notified or the timeout expired, -1 on error or after the last attempt
+     */
+    int restore(bool &notify, int &timeout);
+
+    /**
+     * Schedules the next reconnect attempt after a randomized backoff
+     */
+    void backoff();
+
     // special socket used for thread-safe wake up of waitReadable()
-    Socket_ref mNotify;
+    std::unique_ptr<NotifySocket> mNotify;
+
+    // supervised reconnect
+    bool mSupervised = false, mLost = false;
+    ReconnectPolicy mPolicy;
+    ResubscribeHook mResubscribe;
+    // consecutive failed attempts, time of the drop and of the next attempt
+    uint32_t mAttempts = 0;
+    std::chrono::steady_clock::time_point mLostAt, mNextAttempt;
+    ReconnectStats mReconnectStats;
 };
 
 #endif //COMMONS_PUSHCONNECTION_H
@@ -20,11 +20,42 @@
 #ifndef COMMONS_ISOCKET_H
 #define COMMONS_ISOCKET_H
 
+#include <cerrno>
+#include <cstdint>
+
 #include <enum/network/IPProtocol.h>
 #include <network/ConnectionInfo.h>
 
 struct addrinfo;
 
+/**
+ * Result of a non-blocking socket operation
+ */
+enum class IOStatus {
+    OK,             /**< Data was transferred **/
+    WANT_READ,      /**< Retry the operation once the socket is readable **/
+    WANT_WRITE,     /**< Retry the operation once the socket is writable **/
+    CLOSED,         /**< Connection was closed by peer **/
+    FAILED,         /**< Unrecoverable error **/
+};
+
+/**
+ * Platform socket descriptor, same type as SOCKET
+ */
+#ifdef WIN32
+using NativeSocket = uintptr_t;
+#else
+using NativeSocket = int;
+#endif
+
+/**
+ * Memory region of a gathered write
+ */
+struct IOVector {
+    const void *data;
+    uint32_t size;
+};
+
 class ISocket {
 public:
     explicit ISocket(const ConnectionInfo &info) : mInfo(info) { };
@@ -34,6 +65,82 @@ public:
     virtual ssize_t read(void *data, uint32_t size) = 0;
     virtual ssize_t write(const void *data, uint32_t size) = 0;
 
+    /**
+     * @return Underlying descriptor to wait on, e.g. with poll or epoll
+     */
+    virtual NativeSocket fd() const = 0;
+
+    /**
+     * Reads available data without waiting, regardless of the mode used by blocking calls.
+     *
+     * @param data Target memory
+     * @param size Maximum number of bytes to read
+     * @param read Number of bytes read
+     * @return IOStatus::OK if data was read, IOStatus::WANT_READ if no data is available
+     */
+    virtual IOStatus readNonBlocking(void *data, uint32_t size, uint32_t &read) {
+        (void) data; (void) size;
+        read = 0;
+        return IOStatus::FAILED;
+    }
+
+    /**
+     * Writes as much data as possible without waiting, regardless of the mode used by blocking calls.
+     *
+     * @param data Source memory
+     * @param size Maximum number of bytes to write
+     * @param written Number of bytes written
+     * @return IOStatus::OK if data was written, IOStatus::WANT_WRITE if the socket buffer is full
+     */
+    virtual IOStatus writeNonBlocking(const void *data, uint32_t size, uint32_t &written) {
+        (void) data; (void) size;
+        written = 0;
+        return IOStatus::FAILED;
+    }
+
+    /**
+     * @return True if already received data is buffered in user space, which is not reported by select or poll
+     */
+    virtual bool pending() const {
+        return false;
+    }
+
+    /**
+     * Writes multiple memory regions in order
+     *
+     * @param vectors Memory regions to write
+     * @param count Number of memory regions
+     * @return Number of bytes written, may be less than the total size. Negative on error
+     */
+    virtual ssize_t writev(const IOVector *vectors, uint32_t count) {
+        ssize_t total = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            ssize_t res = write(vectors[i].data, vectors[i].size);
+            if (res < 0)
+                return total > 0 ? total : res;
+
+            total += res;
+            if (static_cast<uint32_t>(res) < vectors[i].size)
+                break;
+        }
+        return total;
+    }
+
+    /**
+     * Sends part of a file without copying it through user space
+     *
+     * @param fd File to send from
+     * @param offset Position of the first byte in the file
+     * @param size Maximum number of bytes to send
+     * @return Number of bytes sent, may be less than size, 0 at the end of the file. Negative on error, with errno
+     * ENOSYS or EINVAL if the socket or file does not support it
+     */
+    virtual ssize_t sendFile(int fd, uint64_t offset, uint32_t size) {
+        (void) fd; (void) offset; (void) size;
+        errno = ENOSYS;
+        return -1;
+    }
+
     IPProtocol protocol() const {
         return mProtocol;
     }
@@ -20,11 +20,17 @@
 #ifndef COMMONS_CERTIFICATESTORAGE_H
 #define COMMONS_CERTIFICATESTORAGE_H
 
+#include <array>
 #include <atomic>
+#include <cstring>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
 
 #include <commons/util/Except.h>
 #include <secure_memory/Buffer.h>
@@ -32,12 +38,21 @@
 DEFINE_ERROR(cert, base_error);
 
 /**
- * Storage for certificate verification management
+ * Storage for certificate verification management. Keys are indexed by the SHA-256 digest of their
+ * SubjectPublicKeyInfo, so verification is a single lookup regardless of the number of keys or their type.
+ *
+ * Verification reads an immutable snapshot of the index that is swapped atomically on every change, so concurrent
+ * handshakes never wait for each other or for key rotation.
  */
 class CertStore {
 public:
     using RSA_ref = std::unique_ptr<RSA, decltype(&RSA_free)>;
 
+    /**
+     * SHA-256 digest of a DER encoded SubjectPublicKeyInfo
+     */
+    using Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
     /**
      * Operational mode
      */
@@ -56,27 +71,21 @@ public:
          */
         Mode mode;
         /**
-         * Key data as OpenSSL structure
+         * Digest of the key's SubjectPublicKeyInfo
          */
-        RSA_ref data;
+        Digest digest;
 
         /**
-         * Creates an empty PublicKey with nullptr data
+         * Creates an empty PublicKey with zero digest
          */
-        PublicKey() : mode(Mode::UNDECIDED), data(nullptr, &RSA_free) { }
+        PublicKey() : mode(Mode::UNDECIDED), digest() { }
 
         /**
-         * Creates an PublicKey with supplied data
+         * Creates an PublicKey with supplied digest
          * @param mode Operational mode
-         * @param data Key data as OpenSSL structure
-         */
-        PublicKey(Mode mode, RSA_ref &data) : mode(mode), data(std::move(data)) { }
-
-        /**
-         * Move constructor to support map insertion operations
-         * @param other Other public key, data is set to nullptr
+         * @param digest Digest of the key's SubjectPublicKeyInfo
          */
-        PublicKey(PublicKey &&other) noexcept : mode(other.mode), data(std::move(other.data)) { }
+        PublicKey(Mode mode, const Digest &digest) : mode(mode), digest(digest) { }
     };
 
     /**
@@ -94,7 +103,7 @@ public:
     /**
      * Adds a public key to certificate storage
      *
-     * @param key Buffer containing PEM encoded public key
+     * @param key Buffer containing PEM encoded public key of any type (RSA, EC, Ed25519, ...)
      * @param mode Operational mode for this key
      * @return Assigned ID for the key
      */
@@ -132,13 +141,52 @@ public:
      */
     bool verify(bool pre, const EVP_PKEY *key) const;
 
+    /**
+     * Checks the public key of a certificate against the storage. Hashes the encoded key without allocating a key.
+     *
+     * @param pre Pre verification
+     * @param cert Certificate to check
+     * @return True if verification succeeded
+     */
+    bool verify(bool pre, const X509 *cert) const;
+
+    /**
+     * Computes the digest of a key's SubjectPublicKeyInfo
+     *
+     * @param key Public key
+     * @param digest Computed digest
+     * @return False if the key could not be encoded
+     */
+    static bool digest(const EVP_PKEY *key, Digest &digest);
+
 protected:
+    struct DigestHash {
+        size_t operator()(const Digest &digest) const {
+            // digest is uniformly distributed already
+            size_t hash;
+            memcpy(&hash, digest.data(), sizeof(hash));
+            return hash;
+        }
+    };
+
+    // effective mode by digest, never modified once published
+    using Index = std::unordered_map<Digest, Mode, DigestHash>;
+
+    bool verify(bool pre, const Digest &digest) const;
+
+    /**
+     * Rebuilds the index from the public key map and publishes it. Must be called with mLock held.
+     */
+    void publish();
+
     static CertStore mInstance;
 
-    // lock for the public key map
+    // lock for writers of the public key map
     std::mutex mLock;
     // public key map
     std::unordered_map<uint16_t, PublicKey> mPublicKeys;
+    // current index snapshot, only accessed with std::atomic_load/atomic_store
+    std::shared_ptr<const Index> mIndex = std::make_shared<const Index>();
     // next id
     uint16_t mNextID = 1;
 };
@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <condition_variable>
+
+#include "native/Native.h"
+
+#include <network/AsyncConnection.h>
+
+/**
+ * Shared workers running blocking connects, so event loop threads never wait for a resolver or a TLS handshake
+ */
+class AsyncConnection::Connector {
+    // number of worker threads
+    static const uint32_t WORKERS = 4;
+
+public:
+    static Connector &getInstance() {
+        static Connector instance;
+        return instance;
+    }
+
+    ~Connector() {
+        {
+            std::lock_guard<std::mutex> guard(mLock);
+            mStopping = true;
+        }
+        mJobCondition.notify_all();
+
+        for (auto &worker : mWorkers)
+            worker.join();
+    }
+
+    void submit(std::function<void()> job) {
+        std::lock_guard<std::mutex> guard(mLock);
+
+        // start workers on first use
+        while (mWorkers.size() < WORKERS)
+            mWorkers.emplace_back(&Connector::run, this);
+
+        mJobs.push_back(std::move(job));
+        mJobCondition.notify_one();
+    }
+
+protected:
+    Connector() = default;
+
+    void run() {
+        std::unique_lock<std::mutex> guard(mLock);
+
+        while (true) {
+            mJobCondition.wait(guard, [this] () { return mStopping || !mJobs.empty(); });
+            if (mStopping)
+                return;
+
+            auto job = std::move(mJobs.front());
+            mJobs.pop_front();
+
+            // connect outside of lock
+            guard.unlock();
+            job();
+            guard.lock();
+        }
+    }
+
+    std::mutex mLock;
+    std::condition_variable mJobCondition;
+    bool mStopping = false;
+
+    std::deque<std::function<void()>> mJobs;
+    std::vector<std::thread> mWorkers;
+};
+
+const uint32_t AsyncConnection::Connector::WORKERS;
+
+AsyncConnection::~AsyncConnection() {
+    disconnect();
+}
+
+void AsyncConnection::connect(Done done) {
+    // a previous connection is replaced
+    disconnect();
+
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mState = State::CONNECTING;
+        mSendTotal = 0;
+        mWatchReadable = true;
+        mWatchWritable = false;
+    }
+
+    auto connecting = std::make_shared<std::promise<void>>();
+    mConnecting = connecting->get_future().share();
+
+    Connector::getInstance().submit([this, connecting, done] () {
+        bool success = establish();
+
+        // from here on, the connection may be destroyed
+        connecting->set_value();
+        done(success);
+    });
+}
+
+void AsyncConnection::disconnect() {
+    // a running connect registers with the event loop, wait for it
+    if (mConnecting.valid())
+        mConnecting.wait();
+
+    bool registered;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        registered = mState == State::CONNECTED;
+        mState = State::DISCONNECTED;
+    }
+
+    // without lock: waits for a running callback, which may wait for the lock
+    if (registered)
+        mLoop.remove(*this);
+
+    Completions completions;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        failAll(completions);
+        Connection::disconnect();
+    }
+    run(completions);
+}
+
+bool AsyncConnection::establish() {
+    // connect outside of lock, operations issued meanwhile are queued
+    bool success = false;
+    try {
+        success = tryConnect();
+    }
+    catch (const std::exception &e) {
+        // e.g. resolve errors, there is nobody to catch them on the worker
+        Log::dbg << "AsyncConnection: connect failed: " << e.what();
+    }
+
+    Completions completions;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+
+        if (success) {
+            mState = State::CONNECTED;
+            mLoop.add(*this, [this] (bool readable, bool writable) {
+                onEvent(readable, writable);
+            });
+
+            // send what was written while connecting, the connection is closed by the error event that follows
+            if (mDeferred.size() > 0) {
+                int res = writeNonBlocking(mDeferred);
+                mDeferred.clear();
+                if (res < 0)
+                    failAll(completions);
+                else {
+                    completeWrites(completions);
+                    updateInterest();
+                }
+            }
+        }
+        else {
+            mState = State::DISCONNECTED;
+            failAll(completions);
+        }
+    }
+    run(completions);
+    return success;
+}
+
+void AsyncConnection::enqueueRead(std::function<int()> parse, Done done) {
+    Completions completions;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+
+        if (mState == State::CONNECTING)
+            mReads.push_back({std::move(parse), std::move(done)});
+        else if (mState == State::CONNECTED) {
+            mReads.push_back({std::move(parse), std::move(done)});
+            // data may already be buffered
+            completeReads(completions);
+
+            // reading was paused: records buffered by TLS do not trigger events, so take them now. On error, watch
+            // the socket again, the connection is closed by the error event that follows.
+            if (!mWatchReadable) {
+                int res = 0;
+                while (!mReads.empty() && (res = receiveNonBlocking()) == 1)
+                    completeReads(completions);
+
+                if (res < 0) {
+                    failAll(completions);
+                    mLoop.setReadable(*this, true);
+                    mWatchReadable = true;
+                }
+                else
+                    updateInterest();
+            }
+        }
+        else
+            completions.emplace_back([done] () { done(false); });
+    }
+    run(completions);
+}
+
+void AsyncConnection::enqueueWrite(const Buffer &buffer, Done done) {
+    Completions completions;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+
+        if (mState == State::CONNECTING) {
+            mDeferred.append(buffer.const_data(), buffer.size());
+            mSendTotal += buffer.size();
+            mWrites.push_back({mSendTotal, std::move(done)});
+        }
+        else if (mState == State::CONNECTED) {
+            int res = writeNonBlocking(buffer);
+            mSendTotal += buffer.size();
+            mWrites.push_back({mSendTotal, std::move(done)});
+
+            // the connection is closed by the error event that follows
+            if (res < 0)
+                failAll(completions);
+            else {
+                completeWrites(completions);
+                updateInterest();
+            }
+        }
+        else
+            completions.emplace_back([done] () { done(false); });
+    }
+    run(completions);
+}
+
+void AsyncConnection::onEvent(bool readable, bool writable) {
+    Completions completions;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        if (mState != State::CONNECTED)
+            return;
+
+        int res = 1;
+        if (readable) {
+            // drain the socket, records buffered by TLS do not trigger further events. Stop once backlogged, an event
+            // while paused is EOF or an error, which the first receive picks up.
+            do {
+                res = receiveNonBlocking();
+                completeReads(completions);
+            } while (res == 1 && !backlogged());
+        }
+
+        if (res >= 0 && (writable || queued() > 0)) {
+            if (flush() < 0)
+                res = -1;
+            completeWrites(completions);
+        }
+
+        if (res < 0)
+            close(completions);
+        else
+            updateInterest();
+    }
+    run(completions);
+}
+
+void AsyncConnection::completeReads(Completions &completions) {
+    // in order: a read only completes once all earlier reads did
+    while (!mReads.empty()) {
+        int res = mReads.front().parse();
+        if (res == 0)
+            break;
+
+        Done done = std::move(mReads.front().done);
+        mReads.pop_front();
+        completions.emplace_back([done, res] () { done(res == 1); });
+    }
+}
+
+void AsyncConnection::completeWrites(Completions &completions) {
+    uint64_t written = mSendTotal - queued();
+
+    while (!mWrites.empty() && mWrites.front().end <= written) {
+        Done done = std::move(mWrites.front().done);
+        mWrites.pop_front();
+        completions.emplace_back([done] () { done(true); });
+    }
+}
+
+void AsyncConnection::failAll(Completions &completions) {
+    for (auto &read : mReads)
+        completions.emplace_back([done = std::move(read.done)] () { done(false); });
+    for (auto &write : mWrites)
+        completions.emplace_back([done = std::move(write.done)] () { done(false); });
+
+    mReads.clear();
+    mWrites.clear();
+    mDeferred.clear();
+}
+
+void AsyncConnection::close(Completions &completions) {
+    // only called from our own callback, so removing does not wait
+    mState = State::DISCONNECTED;
+    mLoop.remove(*this);
+
+    failAll(completions);
+    Connection::disconnect();
+}
+
+void AsyncConnection::updateInterest() {
+    if (mState != State::CONNECTED)
+        return;
+
+    // watch readability only while received data is consumed
+    bool readable = !backlogged();
+    if (readable != mWatchReadable) {
+        mLoop.setReadable(*this, readable);
+        mWatchReadable = readable;
+    }
+
+    // watch writability only while data is queued
+    bool writable = queued() > 0;
+    if (writable != mWatchWritable) {
+        mLoop.setWritable(*this, writable);
+        mWatchWritable = writable;
+    }
+}
@@ -19,35 +19,72 @@
 
 #include "native/Native.h"
 #include "socket/SSLSocket.h"
-#include "Resolve.h"
+#include "HappyEyeballs.h"
+#include "Metrics.h"
 
 #include <network/Connection.h>
 
 // global one-time network init on a per-platform basis
 Native::Init gInit;
-// thread specific SSL context
-thread_local SSLContext SSLContext::mInstance;
+
+const uint32_t Connection::READ_AHEAD;
+const uint32_t Connection::WRITE_CHUNK;
+const uint32_t Connection::METRICS_BATCH;
+
+Connection::~Connection() {
+    publishMetrics();
+}
 
 void Connection::connect() {
+    connect(mInfo.timeoutConnect());
+}
+
+void Connection::connect(uint32_t timeoutConnect) {
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+
     // resolve hostname
     Resolve resolve(mInfo.host(), mInfo.port());
+    auto resolved = steady_clock::now();
 
-    // try to connect to each
-    for (addrinfo *it; resolve.next(it); ) {
-        Socket_ref socket(mInfo.ssl() ? new SSLSocket(mInfo) : new TCPSocket(mInfo));
+    // race connects to all addresses
+    HappyEyeballs race(resolve, timeoutConnect);
+    Socket_ref socket = race.connect([this] () -> TCPSocket* {
+        return mInfo.ssl() ? new SSLSocket(mInfo) : new TCPSocket(mInfo);
+    });
 
-        if (socket->connect(it)) {
-            mSocket = std::move(socket);
-            return;
-        }
-    }
+    if (!socket)
+        throw connection_error("No connectable address could be resolved");
 
-    throw connection_error("No connectable address could be resolved");
+    established(std::move(socket), duration_cast<microseconds>(resolved - start),
+                duration_cast<microseconds>(steady_clock::now() - resolved));
+    Metrics::connects.add();
+}
+
+void Connection::established(Socket_ref socket, std::chrono::microseconds resolve, std::chrono::microseconds connect) {
+    // drop the old connection and its data
+    disconnect();
+    mSocket = std::move(socket);
+    mEstablished = std::chrono::steady_clock::now();
+
+    mStats = ConnectionStats();
+    auto ssl_sock = dynamic_cast<SSLSocket*>(mSocket.get());
+    if (ssl_sock) {
+        mStats.handshake = ssl_sock->handshakeTime();
+        mStats.resumed = ssl_sock->isReused();
+    }
+    mStats.resolve = resolve;
+    // the connect time includes the handshake of the winning socket
+    mStats.connect = std::max(connect - mStats.handshake, std::chrono::microseconds(0));
 }
 
 bool Connection::tryConnect() {
+    return tryConnect(mInfo.timeoutConnect());
+}
+
+bool Connection::tryConnect(uint32_t timeoutConnect) {
     try {
-        connect();
+        connect(timeoutConnect);
         return true;
     }
     catch (const socket_error &e) {
@@ -63,12 +100,17 @@ bool Connection::read(Buffer &buffer, uint32_t size) {
     if (!connected())
         return false;
 
-    uint32_t total = 0;
+    // take read ahead data first
+    uint32_t total = std::min(size, mReceive.size() - mReceiveOffset);
+    buffer.append(mReceive.const_data(mReceiveOffset), total);
+    consumeReceived(total);
+
     ssize_t read = 1;
-    buffer.increase(size, true);
+    buffer.increase(size - total, true);
 
     while (total < size && read > 0) {
         if ((read = mSocket->read(buffer.data(buffer.size()), size - total)) > 0) {
+            countReceived(read);
             total += read;
             buffer.use(static_cast<uint32_t>(read));
         }
@@ -81,15 +123,318 @@ bool Connection::write(const Buffer &buffer) {
     if (!connected())
         return false;
 
-    // try to write
-    ssize_t res = mSocket->write(buffer.const_data(), buffer.size());
-    if (res <= 0)
+    // queued data goes first
+    return writeQueued() && writeAll(buffer.const_data(), buffer.size());
+}
+
+bool Connection::sendFile(int fd, uint64_t offset, uint64_t size) {
+    if (!connected())
+        return false;
+
+    // queued data goes first
+    if (!writeQueued())
+        return false;
+
+    // zero copy as long as the socket and file support it
+    while (size > 0) {
+        // sendfile transfers less than 2 GiB per call
+        auto chunk = static_cast<uint32_t>(std::min<uint64_t>(size, 1u << 30));
+        ssize_t res = mSocket->sendFile(fd, offset, chunk);
+        if (res < 0 && (errno == ENOSYS || errno == EINVAL))
+            break;
+        // 0: the file ended early
+        if (res <= 0)
+            return false;
+
+        countSent(res);
+        offset += static_cast<uint64_t>(res);
+        size -= static_cast<uint64_t>(res);
+    }
+
+    // otherwise through user space in bounded chunks, e.g. for user space TLS
+    std::vector<uint8_t> chunk(static_cast<size_t>(std::min<uint64_t>(size, WRITE_CHUNK)));
+    while (size > 0) {
+        auto length = static_cast<size_t>(std::min<uint64_t>(size, chunk.size()));
+        ssize_t res = Native::pread(fd, chunk.data(), length, offset);
+        if (res <= 0 || !writeAll(chunk.data(), static_cast<uint32_t>(res)))
+            return false;
+
+        offset += static_cast<uint64_t>(res);
+        size -= static_cast<uint64_t>(res);
+    }
+
+    return true;
+}
+
+bool Connection::write(std::istream &stream, uint64_t size) {
+    if (!connected())
+        return false;
+
+    // queued data goes first
+    if (!writeQueued())
+        return false;
+
+    bool untilEnd = size == std::numeric_limits<uint64_t>::max();
+    std::vector<char> chunk(static_cast<size_t>(std::min<uint64_t>(size, WRITE_CHUNK)));
+    while (size > 0) {
+        stream.read(chunk.data(), static_cast<std::streamsize>(std::min<uint64_t>(size, chunk.size())));
+        auto read = static_cast<uint32_t>(stream.gcount());
+        if (read > 0 && !writeAll(chunk.data(), read))
+            return false;
+        size -= read;
+
+        // end of stream or error
+        if (!stream)
+            return untilEnd && !stream.bad();
+    }
+
+    return true;
+}
+
+bool Connection::writeAll(const void *data, uint32_t size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+
+    // write until all bytes are gone, the socket may accept only some of them at once
+    for (uint32_t total = 0; total < size; ) {
+        ssize_t res = mSocket->write(bytes + total, size - total);
+        if (res <= 0)
+            return false;
+
+        countSent(res);
+        total += static_cast<uint32_t>(res);
+    }
+
+    return true;
+}
+
+int Connection::writeNonBlocking(const Buffer &buffer) {
+    if (!connected())
+        return -1;
+
+    // nothing queued: write directly and queue only the unsent tail
+    if (queued() == 0) {
+        uint32_t written = 0;
+        IOStatus status = sendNonBlocking(buffer.const_data(), buffer.size(), written);
+        if (status == IOStatus::CLOSED || status == IOStatus::FAILED)
+            return -1;
+
+        mSend.append(buffer.const_data(written), buffer.size() - written);
+        updateBackpressure();
+        return queued() == 0 ? 1 : 0;
+    }
+
+    // keep order: append to queue, then write the queue
+    mSend.append(buffer);
+    return flush();
+}
+
+int Connection::flush() {
+    if (!connected())
+        return -1;
+
+    switch (sendQueued()) {
+        case IOStatus::OK:
+            return 1;
+        case IOStatus::WANT_READ:
+        case IOStatus::WANT_WRITE:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+IOStatus Connection::sendNonBlocking(const void *data, uint32_t size, uint32_t &written) {
+    IOStatus status = IOStatus::OK;
+    written = 0;
+
+    while (written < size && status == IOStatus::OK) {
+        uint32_t res = 0;
+        status = mSocket->writeNonBlocking(static_cast<const uint8_t*>(data) + written, size - written, res);
+        written += res;
+    }
+
+    countSent(written);
+    return status;
+}
+
+bool Connection::writeQueued() {
+    while (queued() > 0) {
+        ssize_t res = mSocket->write(mSend.const_data(mSendOffset), queued());
+        if (res <= 0)
+            return false;
+
+        countSent(res);
+        mSendOffset += static_cast<uint32_t>(res);
+    }
+
+    mSend.clear();
+    mSendOffset = 0;
+    updateBackpressure();
+    return true;
+}
+
+IOStatus Connection::sendQueued() {
+    uint32_t written = 0;
+    IOStatus status = sendNonBlocking(mSend.const_data(mSendOffset), queued(), written);
+    mSendOffset += written;
+
+    // everything written, start from the beginning
+    if (queued() == 0) {
+        mSend.clear();
+        mSendOffset = 0;
+    }
+    // move the unsent tail to the front once it is only a small part of the buffer
+    else if (mSendOffset > queued()) {
+        uint32_t remaining = queued();
+        memmove(mSend.data(), mSend.data(mSendOffset), remaining);
+        mSend.clear();
+        mSend.use(remaining);
+        mSendOffset = 0;
+    }
+
+    updateBackpressure();
+    return status;
+}
+
+bool Connection::writeBatch(const std::vector<Buffer> &buffers) {
+    if (!connected())
+        return false;
+
+    // queued data goes first
+    if (!writeQueued())
         return false;
 
-    // succeed if all bytes were written
-    return static_cast<uint32_t>(res) == buffer.size();
+    std::vector<IOVector> vectors;
+    vectors.reserve(buffers.size());
+    for (const Buffer &buffer : buffers) {
+        if (buffer.size() > 0)
+            vectors.push_back({buffer.const_data(), buffer.size()});
+    }
+
+    // write until all vectors are gone, a single write may only cover some of them
+    for (auto it = vectors.begin(); it != vectors.end(); ) {
+        ssize_t res = mSocket->writev(&*it, static_cast<uint32_t>(vectors.end() - it));
+        if (res <= 0)
+            return false;
+        countSent(res);
+
+        // skip completely written vectors, advance into the partially written one
+        auto written = static_cast<uint32_t>(res);
+        for (; it != vectors.end() && written >= it->size; ++it)
+            written -= it->size;
+        if (written > 0) {
+            it->data = static_cast<const uint8_t*>(it->data) + written;
+            it->size -= written;
+        }
+    }
+
+    return true;
 }
 
 void Connection::disconnect() {
+    publishMetrics();
     mSocket.reset();
+
+    // drop data of the old connection
+    mReceive.clear();
+    mReceiveOffset = 0;
+    mReceiveMissing = 0;
+    mSend.clear();
+    mSendOffset = 0;
+    mBackpressure = false;
+}
+
+bool Connection::receive() {
+    if (!connected())
+        return false;
+
+    uint32_t space = reserveReceive();
+    ssize_t read = mSocket->read(mReceive.data(mReceive.size()), space);
+    if (read <= 0)
+        return false;
+
+    countReceived(read);
+    mReceive.use(static_cast<uint32_t>(read));
+    return true;
+}
+
+int Connection::receiveNonBlocking() {
+    if (!connected())
+        return -1;
+
+    uint32_t space = reserveReceive(), read = 0;
+
+    IOStatus status = mSocket->readNonBlocking(mReceive.data(mReceive.size()), space, read);
+
+    countReceived(read);
+    mReceive.use(read);
+    switch (status) {
+        case IOStatus::OK:
+            return 1;
+        case IOStatus::WANT_READ:
+        case IOStatus::WANT_WRITE:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+uint32_t Connection::reserveReceive() {
+    // move remaining data to the front, this is usually at most a partial class
+    if (mReceiveOffset > 0) {
+        uint32_t remaining = mReceive.size() - mReceiveOffset;
+        memmove(mReceive.data(), mReceive.data(mReceiveOffset), remaining);
+        mReceive.clear();
+        mReceive.use(remaining);
+        mReceiveOffset = 0;
+    }
+
+    // read at least the missing bytes of a large class
+    uint32_t space = std::max(READ_AHEAD, mReceiveMissing);
+    mReceive.increase(space, true);
+    return space;
+}
+
+void Connection::countReceived(ssize_t size) {
+    if (size <= 0)
+        return;
+
+    if (mStats.bytesIn == 0)
+        mStats.firstByte = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - mEstablished);
+
+    mStats.bytesIn += static_cast<uint64_t>(size);
+    mUnpublishedIn += static_cast<uint64_t>(size);
+    if (mUnpublishedIn >= METRICS_BATCH)
+        publishMetrics();
+}
+
+void Connection::countSent(ssize_t size) {
+    if (size <= 0)
+        return;
+
+    mStats.bytesOut += static_cast<uint64_t>(size);
+    mUnpublishedOut += static_cast<uint64_t>(size);
+    if (mUnpublishedOut >= METRICS_BATCH)
+        publishMetrics();
+}
+
+void Connection::publishMetrics() {
+    if (mUnpublishedIn > 0)
+        Metrics::bytesIn.add(mUnpublishedIn);
+    if (mUnpublishedOut > 0)
+        Metrics::bytesOut.add(mUnpublishedOut);
+
+    mUnpublishedIn = mUnpublishedOut = 0;
+}
+
+void Connection::consumeReceived(uint32_t size) {
+    mReceiveOffset += size;
+
+    // everything consumed, start from the beginning
+    if (mReceiveOffset == mReceive.size()) {
+        mReceive.clear();
+        mReceiveOffset = 0;
+    }
+    mReceiveMissing = 0;
 }
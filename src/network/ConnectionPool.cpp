@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+
+#include <network/ConnectionPool.h>
+#include <flatbuffers/network/HeartBeat.h>
+
+#include "native/Native.h"
+
+ConnectionPool::~ConnectionPool() {
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mStopping = true;
+    }
+    mStopCondition.notify_all();
+
+    if (mMaintenance.joinable())
+        mMaintenance.join();
+}
+
+ConnectionPool::Lease ConnectionPool::acquire(const ConnectionInfo &info) {
+    auto now = Clock::now();
+
+    std::unique_lock<std::mutex> guard(mLock);
+    Key key(info);
+    auto elem = mHosts.find(key);
+
+    // newest connection first, older ones are more likely to have been closed by the peer
+    while (elem != mHosts.end() && !elem->second.idle.empty()) {
+        Idle idle = std::move(elem->second.idle.back());
+        elem->second.idle.pop_back();
+
+        // probe outside of lock, it may block
+        guard.unlock();
+        bool reusable = now - idle.since <= mMaxIdleTime && probe(*idle.conn);
+        guard.lock();
+
+        if (reusable) {
+            mStats.hits++;
+            return Lease(this, std::move(idle.conn));
+        }
+        mStats.evictions++;
+
+        // map may have changed while unlocked
+        elem = mHosts.find(key);
+    }
+    mStats.misses++;
+    guard.unlock();
+
+    // connect outside of lock
+    auto conn = std::make_unique<Connection>(info);
+    conn->connect();
+    return Lease(this, std::move(conn));
+}
+
+void ConnectionPool::setMinIdle(const ConnectionInfo &info, uint32_t count) {
+    std::lock_guard<std::mutex> guard(mLock);
+
+    Host &host = mHosts[Key(info)];
+    host.info = std::make_unique<ConnectionInfo>(info);
+    host.minIdle = count;
+}
+
+void ConnectionPool::setProbe(Probe probe) {
+    std::lock_guard<std::mutex> guard(mLock);
+    mProbe = std::move(probe);
+}
+
+ConnectionPool::Probe ConnectionPool::heartBeatProbe(std::chrono::milliseconds timeout) {
+    return [timeout] (Connection &conn) {
+        // a default constructed HeartBeat has sequence number 0, never send it
+        static std::atomic<uint16_t> gSeqNum(1);
+        uint16_t seqNum;
+        while ((seqNum = gSeqNum++) == 0);
+
+        // an idle connection must not have received anything, otherwise the answer would be misinterpreted
+        if (!conn.alive())
+            return false;
+
+        try {
+            if (!conn.writeProtoClass(HeartBeat(seqNum)))
+                return false;
+
+            // read without blocking past the deadline
+            auto deadline = Clock::now() + timeout;
+            HeartBeat answer;
+            int res;
+            while ((res = conn.parseProtoClass(answer)) == 0) {
+                int read = conn.receiveNonBlocking();
+                if (read < 0)
+                    return false;
+                else if (read > 0)
+                    continue;
+
+                auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+                pollfd fd {};
+                fd.fd = conn.socket()->fd();
+                fd.events = POLLIN;
+                if (remaining.count() <= 0 || Native::poll(&fd, 1, static_cast<int>(remaining.count())) <= 0)
+                    return false;
+            }
+            return res == 1 && answer.seqNum() == seqNum;
+        }
+        catch (const std::exception &e) {
+            Log::dbg << "ConnectionPool: heartbeat failed with " << e.what();
+            return false;
+        }
+    };
+}
+
+void ConnectionPool::maintain() {
+    auto now = Clock::now();
+    std::vector<Idle> candidates;
+    std::vector<ConnectionInfo> missing;
+
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+
+        // take all idle connections out, so they can be probed without holding the lock
+        for (auto &host : mHosts) {
+            for (auto &idle : host.second.idle)
+                candidates.emplace_back(std::move(idle));
+            host.second.idle.clear();
+        }
+    }
+
+    std::vector<Idle> keep;
+    uint64_t evictions = 0;
+    for (auto &idle : candidates) {
+        if (now - idle.since <= mMaxIdleTime && probe(*idle.conn))
+            keep.emplace_back(std::move(idle));
+        else
+            evictions++;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mStats.evictions += evictions;
+
+        // kept connections are older than those released meanwhile
+        for (auto it = keep.rbegin(); it != keep.rend(); ++it) {
+            Host &host = mHosts[Key(it->conn->info())];
+            host.idle.emplace_front(std::move(*it));
+        }
+
+        for (auto &host : mHosts)
+            if (host.second.info)
+                for (auto i = host.second.idle.size(); i < host.second.minIdle; i++)
+                    missing.emplace_back(*host.second.info);
+    }
+
+    // establish warm connections outside of lock
+    for (auto &info : missing) {
+        auto conn = std::make_unique<Connection>(info);
+        if (!conn->tryConnect()) {
+            Log::dbg << "ConnectionPool: warm connection to " << info.host() << " failed";
+            continue;
+        }
+
+        release(std::move(conn), true);
+    }
+}
+
+void ConnectionPool::startMaintenance(std::chrono::milliseconds interval) {
+    L_assert(!mMaintenance.joinable(), connection_pool_error);
+
+    mMaintenance = std::thread([this, interval] () {
+        std::unique_lock<std::mutex> guard(mLock);
+
+        while (!mStopCondition.wait_for(guard, interval, [this] () { return mStopping; })) {
+            guard.unlock();
+            try {
+                maintain();
+            }
+            catch (const std::exception &e) {
+                Log::err << "ConnectionPool: maintenance failed with " << e.what();
+            }
+            guard.lock();
+        }
+    });
+}
+
+ConnectionPool::Stats ConnectionPool::stats() {
+    std::lock_guard<std::mutex> guard(mLock);
+
+    Stats stats = mStats;
+    for (auto &host : mHosts)
+        stats.idle += host.second.idle.size();
+    return stats;
+}
+
+void ConnectionPool::release(Connection_ref conn, bool reuse) {
+    // only pool connections in a clean state
+    if (!reuse || mMaxIdlePerHost == 0 || !conn->connected() || conn->queued() > 0)
+        return;
+
+    std::lock_guard<std::mutex> guard(mLock);
+    Host &host = mHosts[Key(conn->info())];
+
+    // evict the oldest connection
+    if (host.idle.size() >= mMaxIdlePerHost) {
+        host.idle.pop_front();
+        mStats.evictions++;
+    }
+
+    host.idle.push_back({std::move(conn), Clock::now()});
+}
+
+bool ConnectionPool::probe(Connection &conn) {
+    Probe probe;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        probe = mProbe;
+    }
+
+    return probe ? probe(conn) : conn.alive();
+}
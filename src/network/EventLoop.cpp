@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "native/Native.h"
+#include "socket/TCPSocket.h"
+#include "socket/NotifySocket.h"
+
+#include <network/EventLoop.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// handler whose callback is currently executed by this thread
+static thread_local void *gCurrentHandler = nullptr;
+
+static int socketFd(Connection &conn) {
+    L_assert(conn.socket(), event_loop_error);
+    return conn.socket()->fd();
+}
+
+static uint32_t socketEvents(bool writable) {
+    return writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+}
+
+EventLoop::EventLoop(uint32_t threads) : mThreadCount(threads), mStopping(false) {
+    L_assert(threads > 0, event_loop_error);
+
+    mPoll = epoll_create1(EPOLL_CLOEXEC);
+    L_assert(mPoll >= 0, event_loop_error);
+
+    // wake up descriptor is level-triggered and never cleared while stopping, so it wakes all threads
+    mWake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    L_assert(mWake >= 0, event_loop_error);
+
+    epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.fd = mWake;
+    L_assert(epoll_ctl(mPoll, EPOLL_CTL_ADD, mWake, &ev) == 0, event_loop_error);
+}
+
+EventLoop::~EventLoop() {
+    stop();
+
+    ::close(mWake);
+    ::close(mPoll);
+}
+
+void EventLoop::add(Connection &conn, Callback callback, bool writable) {
+    addFd(socketFd(conn), socketEvents(writable), std::move(callback));
+}
+
+void EventLoop::add(PushConnection &conn, Callback callback, NotifyCallback notify) {
+    addFd(socketFd(conn), socketEvents(false), std::move(callback));
+    addFd(conn.mNotify->fd(), EPOLLIN, [notify] (bool, bool) { notify(); });
+}
+
+void EventLoop::setWritable(Connection &conn, bool writable) {
+    modifyFd(socketFd(conn), EPOLLOUT, writable);
+}
+
+void EventLoop::setWritable(PushConnection &conn, bool writable) {
+    modifyFd(socketFd(conn), EPOLLOUT, writable);
+}
+
+void EventLoop::setReadable(Connection &conn, bool readable) {
+    modifyFd(socketFd(conn), EPOLLIN, readable);
+}
+
+void EventLoop::setReadable(PushConnection &conn, bool readable) {
+    modifyFd(socketFd(conn), EPOLLIN, readable);
+}
+
+void EventLoop::remove(Connection &conn) {
+    removeFd(socketFd(conn));
+}
+
+void EventLoop::remove(PushConnection &conn) {
+    removeFd(socketFd(conn));
+    removeFd(conn.mNotify->fd());
+}
+
+void EventLoop::start() {
+    if (!mThreads.empty())
+        return;
+
+    mStopping = false;
+    for (uint32_t i = 0; i < mThreadCount; i++)
+        mThreads.emplace_back(&EventLoop::run, this);
+}
+
+void EventLoop::stop() {
+    if (mThreads.empty())
+        return;
+
+    // wake up all threads
+    mStopping = true;
+    uint64_t value = 1;
+    L_expect(::write(mWake, &value, sizeof(value)) == sizeof(value));
+
+    for (auto &thread : mThreads)
+        thread.join();
+    mThreads.clear();
+
+    // reset wake up descriptor
+    L_expect(::read(mWake, &value, sizeof(value)) == sizeof(value));
+}
+
+void EventLoop::addFd(int fd, uint32_t events, Callback callback) {
+    auto handler = std::make_shared<Handler>();
+    handler->fd = fd;
+    handler->events = events;
+    handler->callback = std::move(callback);
+
+    // operations on handler map need to be guarded
+    std::lock_guard<std::mutex> guard(mLock);
+    L_assert(mHandlers.find(fd) == mHandlers.end(), event_loop_error);
+
+    epoll_event ev {};
+    ev.events = events | EPOLLONESHOT;
+    ev.data.fd = fd;
+    L_assert(epoll_ctl(mPoll, EPOLL_CTL_ADD, fd, &ev) == 0, event_loop_error);
+
+    mHandlers.emplace(fd, std::move(handler));
+}
+
+void EventLoop::modifyFd(int fd, uint32_t events, bool watch) {
+    // operations on handler map need to be guarded
+    std::lock_guard<std::mutex> guard(mLock);
+
+    auto elem = mHandlers.find(fd);
+    L_assert(elem != mHandlers.end(), event_loop_error);
+    if (watch)
+        elem->second->events |= events;
+    else
+        elem->second->events &= ~events;
+
+    // re-arm with new interest, a concurrent dispatch is serialized by the handler's running lock
+    epoll_event ev {};
+    ev.events = elem->second->events | EPOLLONESHOT;
+    ev.data.fd = fd;
+    L_assert(epoll_ctl(mPoll, EPOLL_CTL_MOD, fd, &ev) == 0, event_loop_error);
+}
+
+void EventLoop::removeFd(int fd) {
+    Handler_ref handler;
+    {
+        // operations on handler map need to be guarded
+        std::lock_guard<std::mutex> guard(mLock);
+
+        auto elem = mHandlers.find(fd);
+        L_assert(elem != mHandlers.end(), event_loop_error);
+
+        handler = std::move(elem->second);
+        mHandlers.erase(elem);
+        L_expect(epoll_ctl(mPoll, EPOLL_CTL_DEL, fd, nullptr) == 0);
+    }
+
+    // wait for a running callback to finish, unless we are called from it
+    if (gCurrentHandler == handler.get())
+        handler->removed = true;
+    else {
+        std::lock_guard<std::mutex> running(handler->running);
+        handler->removed = true;
+    }
+}
+
+EventLoop::Handler_ref EventLoop::findFd(int fd) {
+    // operations on handler map need to be guarded
+    std::lock_guard<std::mutex> guard(mLock);
+
+    auto elem = mHandlers.find(fd);
+    return elem == mHandlers.end() ? nullptr : elem->second;
+}
+
+void EventLoop::run() {
+    // few events per wait to distribute ready descriptors among threads
+    epoll_event events[16];
+
+    while (!mStopping) {
+        int count = epoll_wait(mPoll, events, sizeof(events) / sizeof(events[0]), -1);
+        if (count < 0 && errno != EINTR) {
+            Log::err << "EventLoop: epoll_wait failed with " << errno;
+            return;
+        }
+
+        // dispatch all fetched events even when stopping, one-shot descriptors would stay disarmed otherwise
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.fd == mWake)
+                continue;
+
+            // handler could have been removed in the meantime
+            Handler_ref handler = findFd(events[i].data.fd);
+            if (handler)
+                dispatch(handler, events[i].events);
+        }
+    }
+}
+
+void EventLoop::dispatch(const Handler_ref &handler, uint32_t events) {
+    {
+        std::lock_guard<std::mutex> running(handler->running);
+        // removed after it was fetched, the connection may already be gone
+        if (handler->removed)
+            return;
+
+        // EOF and errors are reported as readable
+        bool readable = (events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR)) != 0;
+        bool writable = (events & EPOLLOUT) != 0;
+
+        gCurrentHandler = handler.get();
+        try {
+            handler->callback(readable, writable);
+        }
+        catch (const std::exception &e) {
+            Log::err << "EventLoop: callback threw " << e.what();
+        }
+        gCurrentHandler = nullptr;
+    }
+
+    // operations on handler map need to be guarded
+    std::lock_guard<std::mutex> guard(mLock);
+
+    // re-arm only if still registered
+    auto elem = mHandlers.find(handler->fd);
+    if (elem != mHandlers.end() && elem->second == handler) {
+        epoll_event ev {};
+        ev.events = handler->events | EPOLLONESHOT;
+        ev.data.fd = handler->fd;
+        L_expect(epoll_ctl(mPoll, EPOLL_CTL_MOD, handler->fd, &ev) == 0);
+    }
+}
+
+#else
+
+EventLoop::EventLoop(uint32_t threads) : mThreadCount(threads), mStopping(false) {
+    throw event_loop_error("EventLoop is only supported on Linux");
+}
+
+EventLoop::~EventLoop() = default;
+
+void EventLoop::add(Connection &, Callback, bool) { }
+void EventLoop::add(PushConnection &, Callback, NotifyCallback) { }
+void EventLoop::setWritable(Connection &, bool) { }
+void EventLoop::setWritable(PushConnection &, bool) { }
+void EventLoop::setReadable(Connection &, bool) { }
+void EventLoop::setReadable(PushConnection &, bool) { }
+void EventLoop::remove(Connection &) { }
+void EventLoop::remove(PushConnection &) { }
+void EventLoop::start() { }
+void EventLoop::stop() { }
+
+#endif
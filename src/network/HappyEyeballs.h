@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMONS_HAPPYEYEBALLS_H
+#define COMMONS_HAPPYEYEBALLS_H
+
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <vector>
+
+#include "socket/TCPSocket.h"
+#include "Resolve.h"
+
+/**
+ * Races connects to all resolved addresses (RFC 8305). Address families are interleaved and a new attempt is started
+ * after the attempt delay, or as soon as an attempt failed. The first connect to succeed wins, all others are
+ * cancelled. The overall timeout also bounds the TLS handshake of the winning socket.
+ */
+class HappyEyeballs {
+    using Clock = std::chrono::steady_clock;
+    using TCPSocket_ref = std::unique_ptr<TCPSocket>;
+public:
+    /**
+     * Creates a socket for a connect attempt
+     */
+    using Factory = std::function<TCPSocket*()>;
+
+    /**
+     * @param resolve Resolved addresses, must outlive this object
+     * @param timeout Overall timeout in milliseconds, 0 to wait until all attempts completed
+     * @param attemptDelay Delay between the start of two connect attempts
+     */
+    HappyEyeballs(Resolve &resolve, uint32_t timeout,
+                  std::chrono::milliseconds attemptDelay = std::chrono::milliseconds(250)) :
+                        mTimeout(timeout), mAttemptDelay(attemptDelay) {
+        std::deque<addrinfo*> first, second;
+        int firstFamily = AF_UNSPEC;
+
+        // split by family, keeping the resolver's order within each family
+        for (addrinfo *it; resolve.next(it); ) {
+            if (firstFamily == AF_UNSPEC)
+                firstFamily = it->ai_family;
+
+            (it->ai_family == firstFamily ? first : second).push_back(it);
+        }
+
+        // interleave families, starting with the one preferred by the resolver
+        while (!first.empty() || !second.empty()) {
+            for (auto *family : {&first, &second}) {
+                if (!family->empty()) {
+                    mAddresses.push_back(family->front());
+                    family->pop_front();
+                }
+            }
+        }
+    }
+
+    /**
+     * Runs the race
+     *
+     * @param factory Creates a socket for each attempt
+     * @return Connected socket, nullptr if no connect succeeded in time
+     */
+    TCPSocket_ref connect(const Factory &factory) {
+        auto deadline = Clock::now() + std::chrono::milliseconds(mTimeout);
+        auto nextAttempt = Clock::now();
+
+        std::vector<TCPSocket_ref> pending;
+        auto address = mAddresses.begin();
+
+        while (address != mAddresses.end() || !pending.empty()) {
+            auto now = Clock::now();
+            if (mTimeout > 0 && now >= deadline)
+                break;
+
+            // start next attempt
+            if (address != mAddresses.end() && now >= nextAttempt) {
+                TCPSocket_ref socket(factory());
+                nextAttempt = now + mAttemptDelay;
+
+                IOStatus status = start(*socket, *address++);
+                if (status == IOStatus::OK && finish(*socket, deadline))
+                    return socket;
+                else if (status == IOStatus::WANT_WRITE)
+                    pending.emplace_back(std::move(socket));
+                else // failed immediately, socket is closed before the next attempt starts
+                    nextAttempt = now;
+                continue;
+            }
+
+            // poll has no descriptor limit, unlike select with FD_SETSIZE
+            std::vector<pollfd> fds(pending.size());
+            for (size_t i = 0; i < pending.size(); i++) {
+                fds[i].fd = pending[i]->fd();
+                fds[i].events = POLLOUT;
+            }
+
+            // wake up for the next attempt or the deadline, whichever comes first
+            bool wait = address != mAddresses.end() || mTimeout > 0;
+            auto until = address == mAddresses.end() ? deadline : mTimeout > 0 ? std::min(nextAttempt, deadline)
+                                                                                : nextAttempt;
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count();
+            int timeout = wait ? static_cast<int>(std::min<int64_t>(std::max<int64_t>(remaining, 0), INT_MAX)) : -1;
+
+            int res = Native::poll(fds.data(), static_cast<uint32_t>(fds.size()), timeout);
+            if (res < 0 && errno != EINTR) {
+                Log::dbg << "HappyEyeballs: poll failed with " << errno;
+                break;
+            }
+            else if (res <= 0)
+                continue;
+
+            // check all completed attempts, failed connects are reported as error or hang up
+            auto it = pending.begin();
+            for (auto &fd : fds) {
+                if (!(fd.revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL))) {
+                    ++it;
+                    continue;
+                }
+
+                // winner takes it all, the remaining attempts are cancelled by closing their sockets
+                bool failed = (fd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+                if (!failed && (*it)->connectSucceeded() && finish(**it, deadline))
+                    return std::move(*it);
+
+                // failed attempt -> start the next one right away
+                it = pending.erase(it);
+                nextAttempt = Clock::now();
+            }
+        }
+
+        if (mError)
+            std::rethrow_exception(mError);
+        return nullptr;
+    }
+
+protected:
+    IOStatus start(TCPSocket &socket, addrinfo *addr) {
+        try {
+            return socket.startConnect(addr);
+        }
+        catch (const socket_error &) {
+            // e.g. address family not supported, other addresses may still work
+            mError = std::current_exception();
+            return IOStatus::FAILED;
+        }
+    }
+
+    bool finish(TCPSocket &socket, Clock::time_point deadline) {
+        // the handshake gets the time left, at least a millisecond so it does not fall back to the IO timeout
+        uint32_t timeout = 0;
+        if (mTimeout > 0)
+            timeout = static_cast<uint32_t>(std::max<int64_t>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count(), 1));
+
+        // errors during finish (e.g. certificate verification) are not specific to an address, let them propagate
+        return socket.finishConnect(timeout);
+    }
+
+    // overall timeout in milliseconds
+    uint32_t mTimeout;
+    std::chrono::milliseconds mAttemptDelay;
+    // addresses in order of attempts
+    std::vector<addrinfo*> mAddresses;
+    // last error of a socket that could not be created
+    std::exception_ptr mError;
+};
+
+#endif //COMMONS_HAPPYEYEBALLS_H
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "native/Native.h"
+#include "socket/SSLSocket.h"
+#include "Metrics.h"
+#include "Resolve.h"
+
+#include <network/Listener.h>
+
+const uint32_t Listener::HANDSHAKE_TIMEOUT;
+
+Listener::Listener(ConnectionInfo info, std::string certChain, std::string privateKey)
+        : mInfo(std::move(info)), mCertChain(std::move(certChain)), mPrivateKey(std::move(privateKey)) { }
+
+Listener::~Listener() = default;
+
+void Listener::listen(int backlog) {
+    L_assert(!mSocket, listener_error);
+
+    // shared server context, certificate and key are loaded once
+    if (mInfo.ssl())
+        mContext = &SSLContext::getServerInstance(mCertChain, mPrivateKey);
+
+    // bind the first usable address
+    Resolve resolve(mInfo.host(), mInfo.port());
+    for (addrinfo *addr; !mSocket && resolve.next(addr); ) {
+        std::unique_ptr<TCPSocket> socket(new TCPSocket(mInfo));
+        if (socket->listen(addr, backlog, mReusePort))
+            mSocket = std::move(socket);
+    }
+
+    if (!mSocket)
+        throw listener_error("No resolved address could be bound");
+
+    // find out the port actually bound
+    sockaddr_storage local {};
+    socklen_t len = sizeof(local);
+    L_assert(getsockname(mSocket->fd(), reinterpret_cast<sockaddr*>(&local), &len) == 0, listener_error);
+    mPort = ntohs(local.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6*>(&local)->sin6_port
+                                              : reinterpret_cast<sockaddr_in*>(&local)->sin_port);
+}
+
+std::unique_ptr<Connection> Listener::accept() {
+    std::unique_ptr<Connection> conn;
+    while ((conn = acceptPending())) {
+        // a single failed handshake does not affect the listener
+        if (handshake(*conn))
+            return conn;
+    }
+
+    return nullptr;
+}
+
+std::unique_ptr<Connection> Listener::acceptPending() {
+    while (mSocket && !mClosed) {
+        sockaddr_storage address {};
+        socklen_t length;
+        SOCKET fd = mSocket->accept(address, length);
+        if (fd == INVALID_SOCKET) {
+#ifndef WIN32
+            // interrupted, or the peer gave up before we got to it
+            if (!mClosed && (errno == EINTR || errno == ECONNABORTED))
+                continue;
+#endif
+            return nullptr;
+        }
+
+        // peer address as connection information, settings are inherited
+        char host[NI_MAXHOST], port[NI_MAXSERV];
+        if (getnameinfo(reinterpret_cast<sockaddr*>(&address), length, host, sizeof(host), port, sizeof(port),
+                        NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            Native::close(fd);
+            continue;
+        }
+
+        ConnectionInfo peer(host, static_cast<uint16_t>(std::stoi(port)), mInfo.ssl(), false, "",
+                            CertStore::getInstance(), mInfo.timeoutConnect(), mInfo.timeoutIO());
+        peer.setKernelTLS(mInfo.kernelTLS());
+        peer.setSocketOptions(mInfo.socketOptions());
+
+        // the socket refers to the info of its connection, it is established by handshake()
+        std::unique_ptr<Connection> conn(new Connection(std::move(peer)));
+        if (mContext)
+            conn->mSocket.reset(new SSLSocket(conn->info(), fd, address.ss_family));
+        else
+            conn->mSocket.reset(new TCPSocket(conn->info(), fd, address.ss_family));
+        return conn;
+    }
+
+    return nullptr;
+}
+
+bool Listener::handshake(Connection &conn) {
+    L_assert(conn.mSocket, listener_error);
+
+    try {
+        if (mContext) {
+            uint32_t timeout = mInfo.timeoutIO() > 0 ? mInfo.timeoutIO() : HANDSHAKE_TIMEOUT;
+            static_cast<SSLSocket*>(conn.mSocket.get())->acceptSSL(*mContext, timeout);
+        }
+    }
+    catch (const socket_error &e) {
+        Log::dbg << "Listener: accepted connection failed: " << e.what();
+        conn.disconnect();
+        return false;
+    }
+
+    Connection::Socket_ref socket = std::move(conn.mSocket);
+    conn.established(std::move(socket), std::chrono::microseconds(0), std::chrono::microseconds(0));
+    Metrics::accepts.add();
+    return true;
+}
+
+void Listener::close() {
+    mClosed = true;
+
+    // wakes up threads blocked in accept, the socket is closed on destruction
+    if (mSocket)
+        Native::shutdown(mSocket->fd(), NW__SHUT_RDWR);
+}
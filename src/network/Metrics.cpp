@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Metrics.h"
+
+Metrics::Counter Metrics::connects, Metrics::accepts, Metrics::handshakes, Metrics::resumptions,
+        Metrics::verificationFailures, Metrics::bytesIn, Metrics::bytesOut, Metrics::reconnects, Metrics::downtime;
+
+NetworkStats NetworkStats::snapshot() {
+    NetworkStats stats;
+    stats.connects = Metrics::connects.get();
+    stats.accepts = Metrics::accepts.get();
+    stats.handshakes = Metrics::handshakes.get();
+    stats.resumptions = Metrics::resumptions.get();
+    stats.verificationFailures = Metrics::verificationFailures.get();
+    stats.bytesIn = Metrics::bytesIn.get();
+    stats.bytesOut = Metrics::bytesOut.get();
+    stats.reconnects = Metrics::reconnects.get();
+    stats.downtime = Metrics::downtime.get();
+    return stats;
+}
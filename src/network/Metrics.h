@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMONS_METRICS_H
+#define COMMONS_METRICS_H
+
+#include <atomic>
+
+#include <network/ConnectionStats.h>
+
+/**
+ * Process-wide counters behind NetworkStats. Each counter has its own cache line, so threads updating different
+ * counters do not contend. Traffic is accounted per connection and only added in batches (see
+ * Connection::publishMetrics), so I/O calls do not touch the shared counters.
+ */
+class Metrics {
+public:
+    struct alignas(64) Counter {
+        std::atomic<uint64_t> value {0};
+
+        void add(uint64_t n = 1) {
+            // counters are independent, no ordering required
+            value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        uint64_t get() const {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    static Counter connects, accepts, handshakes, resumptions, verificationFailures, bytesIn, bytesOut, reconnects,
+            downtime;
+};
+
+#endif //COMMONS_METRICS_H
@@ -17,105 +17,238 @@
  * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cmath>
+#include <random>
+
 #include "native/Native.h"
 #include "socket/SSLSocket.h"
 #include "socket/NotifySocket.h"
+#include "Metrics.h"
 
 #include <network/PushConnection.h>
 
+PushConnection::PushConnection(const ConnectionInfo &info) : Connection(info) {
+    // create platform specific notify socket
+    mNotify = std::make_unique<NotifySocket>(mInfo);
+    mNotify->connect(nullptr);
+}
+
+PushConnection::~PushConnection() = default;
+
 bool PushConnection::waitReadable(bool &readable, bool &notify) {
+    int res;
+    // indefinite wait, restarted if interrupted
+    while ((res = pollReadable(readable, notify, -1)) < 0 && errno == EINTR);
+
+    return res >= 0;
+}
+
+int PushConnection::waitReadable(bool &readable, bool &notify, std::chrono::milliseconds timeout) {
+    return waitReadable(readable, notify, std::chrono::steady_clock::now() + timeout);
+}
+
+int PushConnection::waitReadable(bool &readable, bool &notify, std::chrono::steady_clock::time_point deadline) {
+    int res;
+
+    do {
+        // round up, so we do not wake up right before the deadline
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now() + std::chrono::microseconds(999)).count();
+        auto timeout = static_cast<int>(std::min<int64_t>(std::max<int64_t>(remaining, 0), INT32_MAX));
+
+        res = pollReadable(readable, notify, timeout);
+    } while (res < 0 && errno == EINTR);
+
+    return res < 0 ? -1 : res > 0 ? 1 : 0;
+}
+
+int PushConnection::pollReadable(bool &readable, bool &notify, int timeout) {
+    readable = notify = false;
+
+    // supervised: restore the connection before waiting on it
+    if (mLost) {
+        int res = restore(notify, timeout);
+        if (res <= 0)
+            return res;
+    }
+
     // can only wait on established connection
     if (!connected())
-        return false;
-
-    // only tcp+ waiting is supported
-    auto tcp_sock = dynamic_cast<TCPSocket*>(socket());
-    L_assert(tcp_sock, async_connection_error);
-
-    // obtain notify socket
-    auto notify_sock = dynamic_cast<NotifySocket*>(mNotify.get());
-    L_assert(notify_sock, async_connection_error);
-
-    // extract sockets
-    auto sfd = tcp_sock->fd();
-    auto nfd = notify_sock->fd();
-
-    // create a set of sockets for select, add our socket and the notify
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(sfd, &set);
-    FD_SET(nfd, &set);
-
-#ifdef WIN32
-    // ignored on windows
-    int maxfd = 0;
-#else
-    // max socket fd
-    int maxfd = std::max(sfd, nfd);
-#endif
-
-    // indefinite wait for one of sockets to become readable
-    if (Native::select(maxfd + 1, &set, nullptr, nullptr, nullptr) >= 0) {
-        // socket is readable
-        readable = FD_ISSET(sfd, &set);
+        return -1;
+
+    // poll our socket and the notify
+    pollfd fds[2] = {};
+    fds[0].fd = mSocket->fd();
+    fds[0].events = POLLIN;
+    fds[1].fd = mNotify->fd();
+    fds[1].events = POLLIN;
+
+    // data already buffered in user space (decrypted TLS records or read ahead data that was not yet found
+    // incomplete) -> only poll the notify
+    bool pending = mSocket->pending() || (mReceive.size() > mReceiveOffset && mReceiveMissing == 0);
+
+    int res = Native::poll(fds, 2, pending ? 0 : timeout);
+    if (res >= 0) {
+        // socket is readable, EOF and errors included
+        readable = pending || (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
         // notify was sent
-        notify = FD_ISSET(nfd, &set);
+        notify = (fds[1].revents & POLLIN) != 0;
 
-        return true;
+        return readable || notify ? 1 : 0;
     }
 
     // error
-    return false;
+    return res;
 }
 
 int PushConnection::readNonBlocking(Buffer &buffer, uint32_t size) {
     if (!connected())
-        return -1;
+        return mLost ? 0 : -1;
 
-    // only tcp+ is supported
-    auto tcp_sock = dynamic_cast<TCPSocket*>(socket());
-    L_assert(tcp_sock, async_connection_error);
+    // take read ahead data first
+    uint32_t total = std::min(size, mReceive.size() - mReceiveOffset), initial = total;
+    buffer.append(mReceive.const_data(mReceiveOffset), total);
+    consumeReceived(total);
 
-    uint32_t total = 0;
-    ssize_t read = 1;
-    buffer.increase(size, true);
+    IOStatus status = IOStatus::OK;
+    buffer.increase(size - total, true);
 
-    tcp_sock->setNonBlocking(true);
-    while (total < size && read > 0) {
-        if ((read = mSocket->read(buffer.data(buffer.size()), size - total)) > 0) {
+    while (total < size && status == IOStatus::OK) {
+        uint32_t read = 0;
+        if ((status = mSocket->readNonBlocking(buffer.data(buffer.size()), size - total, read)) == IOStatus::OK) {
             total += read;
-            buffer.use(static_cast<uint32_t>(read));
+            buffer.use(read);
         }
     }
-    tcp_sock->setNonBlocking(false);
-
-    // no data available -> retry, we read some data -> success, error/disconnect -> error
-#ifdef WIN32
-    if (read == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
-#else
-    if (read == SOCKET_ERROR && (errno == EINPROGRESS || errno == EAGAIN))
-#endif
-        return 0;
-    else if (read > 0)
-        return 1;
-    else
+    countReceived(total - initial);
+
+    // we read all data -> success, no (complete) data available -> retry, error/disconnect -> error
+    switch (status) {
+        case IOStatus::OK:
+            return 1;
+        case IOStatus::WANT_READ:
+        case IOStatus::WANT_WRITE:
+            return 0;
+        default:
+            // data read before the drop is returned, the drop is noticed by the next read
+            return total > 0 ? 1 : dropped();
+    }
+}
+
+int PushConnection::dropped() {
+    // closed on purpose, or not supervised
+    if (!mSupervised || (!mLost && !connected()))
         return -1;
+
+    if (!mLost) {
+        Log::dbg << "PushConnection: connection to " << mInfo.host() << " dropped, reconnecting";
+        Connection::disconnect();
+
+        mLost = true;
+        mLostAt = std::chrono::steady_clock::now();
+        mAttempts = 0;
+        // even the first attempt is delayed, so clients dropped by a server restart do not return all at once
+        backoff();
+    }
+    return 0;
+}
+
+int PushConnection::restore(bool &notify, int &timeout) {
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+
+    // remaining timeout in milliseconds, -1 for none
+    auto remaining = [&start, timeout] () -> int64_t {
+        if (timeout < 0)
+            return -1;
+        return std::max<int64_t>(timeout - duration_cast<milliseconds>(steady_clock::now() - start).count(), 0);
+    };
+
+    while (true) {
+        // wait for the next attempt, only a notify interrupts the backoff
+        auto now = steady_clock::now();
+        if (now < mNextAttempt) {
+            // round up, so we do not wake up right before the attempt
+            int64_t wait = duration_cast<milliseconds>(mNextAttempt - now + microseconds(999)).count();
+            if (remaining() >= 0)
+                wait = std::min(wait, remaining());
+
+            pollfd fd = {};
+            fd.fd = mNotify->fd();
+            fd.events = POLLIN;
+            int res = Native::poll(&fd, 1, static_cast<int>(std::min<int64_t>(wait, INT32_MAX)));
+            if (res < 0)
+                return res;
+            if (res > 0) {
+                notify = true;
+                return 0;
+            }
+            // the timeout of the caller expired first
+            if (steady_clock::now() < mNextAttempt)
+                return 0;
+        }
+
+        // the attempt must not outlast the timeout of the caller, no time left -> no attempt
+        uint32_t timeoutConnect = mInfo.timeoutConnect();
+        int64_t left = remaining();
+        if (left == 0)
+            return 0;
+        if (left > 0 && (timeoutConnect == 0 || timeoutConnect > left))
+            timeoutConnect = static_cast<uint32_t>(left);
+
+        bool success = tryConnect(timeoutConnect);
+        if (success && mResubscribe && !mResubscribe(*this)) {
+            Log::dbg << "PushConnection: resubscribe failed";
+            Connection::disconnect();
+            success = false;
+        }
+
+        if (success) {
+            auto downtime = duration_cast<microseconds>(steady_clock::now() - mLostAt);
+            mReconnectStats.reconnects++;
+            mReconnectStats.lastDowntime = downtime;
+            mReconnectStats.totalDowntime += downtime;
+            Metrics::reconnects.add();
+            Metrics::downtime.add(static_cast<uint64_t>(downtime.count()));
+
+            mLost = false;
+            if (timeout >= 0)
+                timeout = static_cast<int>(remaining());
+            return 1;
+        }
+
+        mReconnectStats.failedAttempts++;
+        if (++mAttempts == mPolicy.maxAttempts) {
+            Log::dbg << "PushConnection: giving up after " << mAttempts << " attempts";
+            mLost = false;
+            errno = ENOTCONN;
+            return -1;
+        }
+        backoff();
+    }
+}
+
+void PushConnection::backoff() {
+    // exponential ceiling, full jitter below it
+    static thread_local std::minstd_rand random(std::random_device{}());
+
+    double ceiling = mPolicy.initialDelay.count() * std::pow(mPolicy.factor, mAttempts);
+    ceiling = std::min(ceiling, static_cast<double>(mPolicy.maxDelay.count()));
+    std::uniform_real_distribution<double> jitter(0, std::max(ceiling, 0.0));
+
+    mNextAttempt = std::chrono::steady_clock::now() + std::chrono::microseconds(
+            static_cast<int64_t>(jitter(random) * 1000));
 }
 
 void PushConnection::notify() {
-    auto notify_sock = dynamic_cast<NotifySocket*>(mNotify.get());
-    if (notify_sock)
-        notify_sock->notify();
+    mNotify->notify();
 }
 
 void PushConnection::clear() {
-    auto notify_sock = dynamic_cast<NotifySocket*>(mNotify.get());
-    if (notify_sock)
-        notify_sock->clear();
+    mNotify->clear();
 }
 
 void PushConnection::clearAll() {
-    // create platform specific notify socket
-    mNotify = std::make_unique<NotifySocket>(mInfo);
-    mNotify->connect(nullptr);
+    // drains in place, so the descriptor stays valid for waiting threads and event loops
+    mNotify->clearAll();
 }
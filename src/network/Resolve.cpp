@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+
+#include "Resolve.h"
+
+class Resolve::Cache {
+    using Promise_ref = std::shared_ptr<std::promise<Result_ref>>;
+
+    struct Job {
+        std::string host;
+        uint16_t port;
+        Promise_ref promise;
+    };
+
+    // maximum number of cached names before expired ones are purged
+    static const size_t PURGE_SIZE = 1024;
+    // number of worker threads
+    static const uint32_t WORKERS = 4;
+
+public:
+    static Cache &getInstance() {
+        static Cache instance;
+        return instance;
+    }
+
+    ~Cache() {
+        {
+            std::lock_guard<std::mutex> guard(mLock);
+            mStopping = true;
+        }
+        mJobCondition.notify_all();
+
+        for (auto &worker : mWorkers)
+            worker.join();
+    }
+
+    std::shared_future<Result_ref> lookup(const std::string &host, uint16_t port) {
+        std::string key = host + ":" + std::to_string(port);
+        std::lock_guard<std::mutex> guard(mLock);
+
+        // cached or in flight
+        auto elem = mEntries.find(key);
+        if (elem != mEntries.end()) {
+            if (!expired(elem->second, Clock::now()))
+                return elem->second;
+        }
+
+        if (mEntries.size() >= PURGE_SIZE)
+            purge();
+
+        // start workers on first use
+        while (mWorkers.size() < WORKERS)
+            mWorkers.emplace_back(&Cache::run, this);
+
+        auto promise = std::make_shared<std::promise<Result_ref>>();
+        std::shared_future<Result_ref> future = promise->get_future().share();
+        mEntries[key] = future;
+
+        mJobs.push_back({host, port, std::move(promise)});
+        mJobCondition.notify_one();
+        return future;
+    }
+
+    void setTTL(std::chrono::milliseconds ttl, std::chrono::milliseconds negativeTTL) {
+        std::lock_guard<std::mutex> guard(mLock);
+        mTTL = ttl;
+        mNegativeTTL = negativeTTL;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(mLock);
+        // in flight lookups complete, but are not cached anymore
+        mEntries.clear();
+    }
+
+protected:
+    Cache() = default;
+
+    /**
+     * @return True if the lookup completed and its result expired. A failed lookup is expired right away, since its
+     * exception would be rethrown by every access otherwise.
+     */
+    static bool expired(const std::shared_future<Result_ref> &future, Clock::time_point now) {
+        if (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return false;
+
+        try {
+            return now >= future.get()->expires;
+        }
+        catch (...) {
+            return true;
+        }
+    }
+
+    void purge() {
+        auto now = Clock::now();
+
+        for (auto it = mEntries.begin(); it != mEntries.end(); ) {
+            if (expired(it->second, now))
+                it = mEntries.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> guard(mLock);
+
+        while (true) {
+            mJobCondition.wait(guard, [this] () { return mStopping || !mJobs.empty(); });
+            if (mStopping)
+                return;
+
+            Job job = std::move(mJobs.front());
+            mJobs.pop_front();
+
+            // resolve outside of lock
+            guard.unlock();
+            std::shared_ptr<Result> result;
+            try {
+                result = resolve(job.host, job.port);
+            }
+            catch (...) {
+                job.promise->set_exception(std::current_exception());
+                guard.lock();
+                continue;
+            }
+            guard.lock();
+
+            // negative caching only for names that definitely do not resolve, other errors may be temporary
+            bool negative = result->error == EAI_NONAME || (result->error == 0 && result->addresses.empty());
+            if (result->error == 0 && !result->addresses.empty())
+                result->expires = Clock::now() + mTTL;
+            else if (negative)
+                result->expires = Clock::now() + mNegativeTTL;
+            else
+                result->expires = Clock::now();
+
+            job.promise->set_value(std::move(result));
+        }
+    }
+
+    static std::shared_ptr<Result> resolve(const std::string &host, uint16_t port) {
+        auto result = std::make_shared<Result>();
+        addrinfo query{}, *list = nullptr;
+
+        // query all families (v4 and v6)
+        query.ai_family = PF_UNSPEC;
+        // query only TCP
+        query.ai_socktype = SOCK_STREAM;
+        query.ai_protocol = IPPROTO_TCP;
+
+        // resolve hostname
+        result->error = Native::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &query, &list);
+        if (result->error != 0 || !list)
+            return result;
+
+        // copy addresses, so the list can be freed right away
+        for (addrinfo *it = list; it; it = it->ai_next) {
+            if (it->ai_addrlen > sizeof(sockaddr_storage))
+                continue;
+
+            addrinfo copy = *it;
+            copy.ai_canonname = nullptr;
+            copy.ai_next = nullptr;
+            result->addresses.push_back(copy);
+
+            sockaddr_storage storage {};
+            memcpy(&storage, it->ai_addr, it->ai_addrlen);
+            result->storage.push_back(storage);
+        }
+        Native::freeaddrinfo(list);
+
+        // chain copies
+        for (size_t i = 0; i < result->addresses.size(); i++) {
+            result->addresses[i].ai_addr = reinterpret_cast<sockaddr*>(&result->storage[i]);
+            if (i + 1 < result->addresses.size())
+                result->addresses[i].ai_next = &result->addresses[i + 1];
+        }
+
+        return result;
+    }
+
+    // lock for entries, jobs and configuration
+    std::mutex mLock;
+    // results and lookups in flight by host:port
+    std::unordered_map<std::string, std::shared_future<Result_ref>> mEntries;
+    std::chrono::milliseconds mTTL = std::chrono::seconds(60);
+    std::chrono::milliseconds mNegativeTTL = std::chrono::seconds(5);
+
+    // worker pool
+    std::vector<std::thread> mWorkers;
+    std::deque<Job> mJobs;
+    std::condition_variable mJobCondition;
+    bool mStopping = false;
+};
+
+std::shared_future<Resolve::Result_ref> Resolve::lookup(const std::string &host, uint16_t port) {
+    return Cache::getInstance().lookup(host, port);
+}
+
+void Resolve::setTTL(std::chrono::milliseconds ttl, std::chrono::milliseconds negativeTTL) {
+    Cache::getInstance().setTTL(ttl, negativeTTL);
+}
+
+void Resolve::clearCache() {
+    Cache::getInstance().clear();
+}
@@ -20,33 +20,56 @@
 #ifndef COMMONS_RESOLVE_H
 #define COMMONS_RESOLVE_H
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "native/Native.h"
+
 DEFINE_ERROR(resolve, base_error);
 
+/**
+ * Resolves a host name to its TCP addresses. Lookups run on a pool of worker threads and their results are cached,
+ * concurrent lookups of the same name wait for the same worker.
+ */
 class Resolve {
-    using addrinfo_ref = std::unique_ptr<addrinfo, decltype(&freeaddrinfo)>;
+    using Clock = std::chrono::steady_clock;
 public:
-    Resolve(const std::string &host, uint16_t port) : mResult(nullptr, &Native::freeaddrinfo) {
-        addrinfo query{}, *result;
-
-        // query all families (v4 and v6)
-        query.ai_family = PF_UNSPEC;
-        // query only TCP
-        query.ai_socktype = SOCK_STREAM;
-        query.ai_protocol = IPPROTO_TCP;
-
-        // resolve hostname
-        int res = Native::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &query, &result);
-        if (res == 0 && result)
-            mResult.reset(result);
-        else
-            throw resolve_error("Resolve error: " + std::to_string(res));
+    /**
+     * Lookup result. Owns a copy of the addresses, so it can be shared between threads.
+     */
+    struct Result {
+        // getaddrinfo result code
+        int error = 0;
+        // addresses, chained in order of the resolver
+        std::vector<addrinfo> addresses;
+        std::vector<sockaddr_storage> storage;
+        // time after which the result is looked up again
+        Clock::time_point expires;
+    };
+    using Result_ref = std::shared_ptr<const Result>;
+
+    /**
+     * Resolves the host, blocks until its addresses are available
+     *
+     * @param host Host name or address
+     * @param port Port
+     */
+    Resolve(const std::string &host, uint16_t port) : mResult(lookup(host, port).get()) {
+        if (mResult->error != 0 || mResult->addresses.empty())
+            throw resolve_error("Resolve error: " + std::to_string(mResult->error));
     }
 
     bool next(addrinfo *&out) {
         // advance iterator
-        if (mResult && !mIterator)
-            mIterator = mResult.get();
-        else if (mResult && mIterator->ai_next)
+        if (!mIterator && !mResult->addresses.empty())
+            mIterator = const_cast<addrinfo*>(&mResult->addresses.front());
+        else if (mIterator && mIterator->ai_next)
             mIterator = mIterator->ai_next;
         else
             return false;
@@ -55,8 +78,33 @@ public:
         return true;
     }
 
+    /**
+     * Resolves the host without blocking the caller
+     *
+     * @param host Host name or address
+     * @param port Port
+     * @return Future of the lookup result, ready immediately if cached
+     */
+    static std::shared_future<Result_ref> lookup(const std::string &host, uint16_t port);
+
+    /**
+     * Sets how long results are cached
+     *
+     * @param ttl Lifetime of successful lookups
+     * @param negativeTTL Lifetime of lookups for names that do not exist
+     */
+    static void setTTL(std::chrono::milliseconds ttl, std::chrono::milliseconds negativeTTL);
+
+    /**
+     * Drops all cached results
+     */
+    static void clearCache();
+
 protected:
-    addrinfo_ref mResult;
+    class Cache;
+
+    Result_ref mResult;
+    // addresses are not modified, but addrinfo is passed around as non-const
     addrinfo *mIterator = nullptr;
 };
 
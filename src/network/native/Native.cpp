@@ -18,6 +18,18 @@
  */
 
 #include "Native.h"
+#include <network/socket/ISocket.h>
+
+#include <algorithm>
+
+#ifdef WIN32
+    #include <io.h>
+#else
+    #include <sys/uio.h>
+#endif
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif
 
 int ::Native::getaddrinfo(const char *__name, const char *__service, const struct addrinfo *__req,
                                  struct addrinfo **__pai) {
@@ -52,15 +64,87 @@ int ::Native::connect(int __fd, const sockaddr *__addr, socklen_t __len) {
     return ::connect(__fd, __addr, __len);
 }
 
+int ::Native::bind(int __fd, const sockaddr *__addr, socklen_t __len) {
+    return ::bind(__fd, __addr, __len);
+}
+
+int ::Native::listen(int __fd, int backlog) {
+    return ::listen(__fd, backlog);
+}
+
+int ::Native::accept(int __fd, sockaddr *__addr, socklen_t *__len) {
+    return ::accept(__fd, __addr, __len);
+}
+
 int ::Native::select(int ndfs, fd_set *_read, fd_set *_write, fd_set *_except, timeval *timeout) {
     return ::select(ndfs, _read, _write, _except, timeout);
 }
 
-ssize_t (::Native::recv(int socket, void *buffer, size_t length)) {
-    return ::recv(socket, static_cast<char*>(buffer), length, 0);
+int ::Native::poll(pollfd *fds, uint32_t count, int timeout) {
+#ifdef WIN32
+    return ::WSAPoll(fds, count, timeout);
+#else
+    return ::poll(fds, count, timeout);
+#endif
+}
+
+ssize_t (::Native::recv(int socket, void *buffer, size_t length, int flags)) {
+    return ::recv(socket, static_cast<char*>(buffer), length, flags);
 }
 
-ssize_t (::Native::send(int socket, const void *buffer, size_t length)) {
-    return ::send(socket, static_cast<const char*>(buffer), length, 0);
+ssize_t (::Native::send(int socket, const void *buffer, size_t length, int flags)) {
+    return ::send(socket, static_cast<const char*>(buffer), length, flags);
 }
 
+ssize_t (::Native::sendv(int socket, const IOVector *vectors, uint32_t count)) {
+    // gather at most this many regions per call, the caller continues after a partial write
+    const uint32_t maxCount = 64;
+    count = std::min(count, maxCount);
+
+#ifdef WIN32
+    WSABUF buffers[maxCount];
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i].buf = static_cast<CHAR*>(const_cast<void*>(vectors[i].data));
+        buffers[i].len = vectors[i].size;
+    }
+
+    DWORD sent = 0;
+    if (WSASend(socket, buffers, count, &sent, 0, nullptr, nullptr) != 0)
+        return SOCKET_ERROR;
+    return sent;
+#else
+    iovec buffers[maxCount];
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i].iov_base = const_cast<void*>(vectors[i].data);
+        buffers[i].iov_len = vectors[i].size;
+    }
+
+    msghdr msg {};
+    msg.msg_iov = buffers;
+    msg.msg_iovlen = count;
+    return ::sendmsg(socket, &msg, 0);
+#endif
+}
+
+ssize_t (::Native::sendfile(int socket, int in_fd, uint64_t offset, size_t count)) {
+#ifdef __linux__
+    auto off = static_cast<off_t>(offset);
+    return ::sendfile(socket, in_fd, &off, count);
+#else
+    // callers fall back to reading the file
+    (void) socket; (void) in_fd; (void) offset; (void) count;
+    errno = ENOSYS;
+    return SOCKET_ERROR;
+#endif
+}
+
+ssize_t (::Native::pread(int fd, void *buffer, size_t length, uint64_t offset)) {
+#ifdef WIN32
+    // not atomic, the file offset is changed
+    if (::_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0)
+        return -1;
+    return ::_read(fd, buffer, static_cast<unsigned int>(length));
+#else
+    return ::pread(fd, buffer, length, static_cast<off_t>(offset));
+#endif
+}
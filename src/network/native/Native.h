@@ -26,11 +26,15 @@
     #include <ws2tcpip.h>
     #include <wincrypt.h>
     #define NW__SHUT_RDWR SD_BOTH
+    // no per-call flag, sockets are switched to non-blocking mode instead
+    #define NW__MSG_DONTWAIT 0
 #else
     #include <unistd.h>
     #include <sys/socket.h>
     #include <arpa/inet.h>
+    #include <netinet/tcp.h>
     #include <netdb.h>
+    #include <poll.h>
     #include <fcntl.h>
     #include <dirent.h>
     #include <cerrno>
@@ -38,6 +42,7 @@
     #define INVALID_SOCKET  (~0)
     #define SOCKET_ERROR    (-1)
     #define NW__SHUT_RDWR SHUT_RDWR
+    #define NW__MSG_DONTWAIT MSG_DONTWAIT
 #endif
 
 #include <openssl/ssl.h>
@@ -45,6 +50,8 @@
 #include <commons/util/Except.h>
 #include <commons/util/File.h>
 
+struct IOVector;
+
 #define _BEGIN_NATIVE_NAMESPACE namespace Native {
 #define _END_NATIVE_NAMESPACE }
 
@@ -215,11 +222,25 @@ int getsockopt(int __fd, int level, int optname, char *optval, socklen_t *optlen
 
 int connect(int __fd, const sockaddr *__addr, socklen_t __len);
 
+int bind(int __fd, const sockaddr *__addr, socklen_t __len);
+
+int listen(int __fd, int backlog);
+
+int accept(int __fd, sockaddr *__addr, socklen_t *__len);
+
 int select(int ndfs, fd_set *_read, fd_set *_write, fd_set *_except, timeval *timeout);
 
-ssize_t recv(int __fd, void *buffer, size_t length);
+int poll(pollfd *fds, uint32_t count, int timeout);
+
+ssize_t recv(int __fd, void *buffer, size_t length, int flags = 0);
+
+ssize_t send(int __fd, const void *buffer, size_t length, int flags = 0);
+
+ssize_t sendv(int __fd, const IOVector *vectors, uint32_t count);
+
+ssize_t sendfile(int __fd, int in_fd, uint64_t offset, size_t count);
 
-ssize_t send(int __fd, const void *buffer, size_t length);
+ssize_t pread(int fd, void *buffer, size_t length, uint64_t offset);
 
 static Init gInit;
 
@@ -22,15 +22,25 @@
 
 #include <network/socket/ISocket.h>
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 DEFINE_ERROR(notify_socket, base_error);
 
-class NotifySocket : public ISocket {
+/**
+ * Wakes up a thread waiting for the rx descriptor. On Linux, notifies are coalesced into the counter of an eventfd.
+ * Elsewhere, a connected socket pair carries one byte per notify.
+ */
+class NotifySocket final : public ISocket {
 public:
     explicit NotifySocket(const ConnectionInfo &info) : ISocket(info) { }
 
     ~NotifySocket() override {
-        Native::close(mRxSocket);
-        Native::close(mTxSocket);
+        if (mRxSocket != INVALID_SOCKET)
+            Native::close(mRxSocket);
+        if (mTxSocket != INVALID_SOCKET)
+            Native::close(mTxSocket);
     }
 
 #ifdef WIN32
@@ -69,6 +79,17 @@ public:
 
         // clean up temp socket
         Native::close(sock);
+
+        // clearing must not block if no notify is pending
+        u_long mode = 1;
+        ioctlsocket(mRxSocket, FIONBIO, &mode);
+        return true;
+    }
+#elif defined(__linux__)
+    bool connect(addrinfo *) override {
+        // one descriptor for both ends, the counter coalesces all notifies
+        mRxSocket = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        L_assert(mRxSocket != INVALID_SOCKET, notify_socket_error);
         return true;
     }
 #else
@@ -80,10 +101,45 @@ public:
         // save descriptors
         mRxSocket = fds[0];
         mTxSocket = fds[1];
+
+        // clearing must not block if no notify is pending
+        fcntl(mRxSocket, F_SETFL, fcntl(mRxSocket, F_GETFL, NULL) | O_NONBLOCK);
         return true;
     }
 #endif
 
+#ifdef __linux__
+    /**
+     * Increments the counter to notify the receiving end
+     */
+    void notify() {
+        uint64_t value = 1;
+        L_assert(write(&value, sizeof(value)) == sizeof(value), notify_socket_error);
+    }
+
+    /**
+     * Clears all pending notifies, since they are coalesced. Does nothing if no notify is pending.
+     */
+    void clear() {
+        clearAll();
+    }
+
+    /**
+     * Resets the counter in a single read. Does nothing if no notify is pending.
+     */
+    void clearAll() {
+        uint64_t value;
+        read(&value, sizeof(value));
+    }
+
+    ssize_t read(void *data, uint32_t size) override {
+        return ::read(mRxSocket, data, size);
+    }
+
+    ssize_t write(const void *data, uint32_t size) override {
+        return ::write(mRxSocket, data, size);
+    }
+#else
     /**
      * Sends one byte to notify the receiving end
      */
@@ -93,11 +149,19 @@ public:
     }
 
     /**
-     * Clears a notification
+     * Clears one notify. Does nothing if no notify is pending.
      */
     void clear() {
         uint8_t message;
-        L_assert(read(&message, sizeof(message)) == sizeof(message), notify_socket_error);
+        read(&message, sizeof(message));
+    }
+
+    /**
+     * Clears all pending notifies
+     */
+    void clearAll() {
+        uint8_t messages[256];
+        while (read(messages, sizeof(messages)) > 0);
     }
 
     ssize_t read(void *data, uint32_t size) override {
@@ -107,11 +171,12 @@ public:
     ssize_t write(const void *data, uint32_t size) override {
         return Native::send(mTxSocket, data, size);
     }
+#endif
 
     /**
      * @return Underlying rx socket
      */
-    SOCKET fd() const {
+    NativeSocket fd() const override {
         return mRxSocket;
     }
 
@@ -20,19 +20,28 @@
 #ifndef COMMONS_SSLSOCKET_H
 #define COMMONS_SSLSOCKET_H
 
+#include <chrono>
+
 #include <openssl/err.h>
 
 #include "TCPSocket.h"
 #include "../ssl/SSLContext.h"
+#include "../Metrics.h"
 
 DEFINE_ERROR(ssl_socket, socket_error);
 DEFINE_ERROR(ssl_verification, ssl_socket_error);
 
-class SSLSocket : public TCPSocket {
+class SSLSocket final : public TCPSocket {
     using SSL_ref = std::unique_ptr<SSL, decltype(&SSL_free)>;
 public:
     explicit SSLSocket(const ConnectionInfo &info) : TCPSocket(info), mSSL(nullptr, &SSL_free) {}
 
+    /**
+     * Takes ownership of an accepted socket, the handshake is performed by acceptSSL
+     */
+    SSLSocket(const ConnectionInfo &info, SOCKET accepted, int family)
+            : TCPSocket(info, accepted, family), mSSL(nullptr, &SSL_free) {}
+
     ~SSLSocket() override {
         if (mSSL) {
             // gracefully shut down ssl
@@ -47,91 +56,361 @@ public:
         return SSL_session_reused(mSSL.get()) == 1;
     }
 
-    bool connect(addrinfo *addr) override {
-        return TCPSocket::connect(addr) && initSSL();
+    /**
+     * @return Native OpenSSL object, nullptr before the handshake started
+     */
+    SSL *ssl() const {
+        return mSSL.get();
+    }
+
+    /**
+     * @return True if the kernel encrypts outgoing records, so plain writes to fd() produce TLS records
+     */
+    bool kernelTLS() const {
+        return mKernelSend;
+    }
+
+    /**
+     * @return Duration of the TLS handshake, zero until it completed
+     */
+    std::chrono::microseconds handshakeTime() const {
+        return mHandshakeTime;
+    }
+
+    bool finishConnect(uint32_t timeout = 0) override {
+        return TCPSocket::finishConnect() && initSSL(timeout);
+    }
+
+    /**
+     * Performs the server side TLS handshake on an accepted socket. A client that stalls the handshake must not block
+     * the accepting thread, so it is bounded by a deadline.
+     *
+     * @param context Server context holding certificate and key
+     * @param timeout Maximum duration of the handshake in milliseconds
+     */
+    void acceptSSL(SSLContext &context, uint32_t timeout) {
+        createSSL(context);
+        SSL_set_accept_state(mSSL.get());
+
+        mHandshakeStart = std::chrono::steady_clock::now();
+        handshake(mHandshakeStart + std::chrono::milliseconds(timeout));
     }
 
     ssize_t read(void *data, uint32_t size) override {
+        setNonBlocking(false);
         return SSL_read(mSSL.get(), data, size);
     }
 
     ssize_t write(const void *data, uint32_t size) override {
+        setNonBlocking(false);
+        // kernel TLS: the kernel frames and encrypts, skip the copy into OpenSSL's record buffer
+        if (mKernelSend)
+            return TCPSocket::write(data, size);
+
         return SSL_write(mSSL.get(), data, size);
     }
 
+    /**
+     * Coalesces the memory regions into full-size TLS records instead of writing one record per region.
+     * With kernel TLS, the regions are passed to the kernel as they are.
+     */
+    ssize_t writev(const IOVector *vectors, uint32_t count) override {
+        setNonBlocking(false);
+        if (mKernelSend)
+            return TCPSocket::writev(vectors, count);
+
+        const uint32_t recordSize = SSL3_RT_MAX_PLAIN_LENGTH;
+        uint8_t record[recordSize];
+        uint32_t used = 0;
+        ssize_t total = 0;
+
+        // writes the coalesced record, returns false on short write or error
+        auto flush = [&] () {
+            if (used == 0)
+                return true;
+
+            int res = SSL_write(mSSL.get(), record, used);
+            if (res > 0)
+                total += res;
+            bool success = res > 0 && static_cast<uint32_t>(res) == used;
+            used = 0;
+            return success;
+        };
+
+        for (uint32_t i = 0; i < count; i++) {
+            auto data = static_cast<const uint8_t*>(vectors[i].data);
+            uint32_t size = vectors[i].size;
+
+            while (size > 0) {
+                if (used == 0 && size >= recordSize) {
+                    // nothing coalesced yet: write all full records directly without copying
+                    uint32_t direct = size - size % recordSize;
+                    int res = SSL_write(mSSL.get(), data, direct);
+                    if (res > 0)
+                        total += res;
+                    if (res <= 0 || static_cast<uint32_t>(res) != direct)
+                        return total > 0 ? total : res;
+
+                    data += direct;
+                    size -= direct;
+                }
+                else {
+                    // fill up the current record
+                    uint32_t copy = std::min(size, recordSize - used);
+                    memcpy(record + used, data, copy);
+                    used += copy;
+                    data += copy;
+                    size -= copy;
+
+                    if (used == recordSize && !flush())
+                        return total > 0 ? total : -1;
+                }
+            }
+        }
+
+        if (!flush())
+            return total > 0 ? total : -1;
+        return total;
+    }
+
+    /**
+     * Only kernel TLS can send files directly, OpenSSL has to encrypt them in user space otherwise
+     */
+    ssize_t sendFile(int fd, uint64_t offset, uint32_t size) override {
+        if (mKernelSend) {
+            setNonBlocking(false);
+            return TCPSocket::sendFile(fd, offset, size);
+        }
+
+        return ISocket::sendFile(fd, offset, size);
+    }
+
+    /**
+     * Reads decrypted data without waiting. Continues a pending handshake first.
+     * A partially received TLS record stays buffered in OpenSSL until the rest arrives.
+     * OpenSSL's socket BIO takes no per-call flags, so the socket stays non-blocking until the next blocking call.
+     */
+    IOStatus readNonBlocking(void *data, uint32_t size, uint32_t &read) override {
+        read = 0;
+        setNonBlocking(true);
+
+        IOStatus state = handshake();
+        if (state != IOStatus::OK)
+            return state;
+
+        int res = SSL_read(mSSL.get(), data, size);
+        if (res > 0)
+            read = static_cast<uint32_t>(res);
+        return sslStatus(res);
+    }
+
+    /**
+     * Writes as many TLS records as possible without waiting. Continues a pending handshake first.
+     * After IOStatus::WANT_READ or IOStatus::WANT_WRITE the call must be repeated with the same data.
+     */
+    IOStatus writeNonBlocking(const void *data, uint32_t size, uint32_t &written) override {
+        written = 0;
+        setNonBlocking(true);
+
+        IOStatus state = handshake();
+        if (state != IOStatus::OK)
+            return state;
+
+        if (mKernelSend)
+            return TCPSocket::writeNonBlocking(data, size, written);
+
+        int res = SSL_write(mSSL.get(), data, size);
+        if (res > 0)
+            written = static_cast<uint32_t>(res);
+        return sslStatus(res);
+    }
+
+    bool pending() const override {
+        return mSSL && SSL_pending(mSSL.get()) > 0;
+    }
+
+    /**
+     * Performs or continues the TLS handshake. On a non-blocking socket this returns
+     * IOStatus::WANT_READ or IOStatus::WANT_WRITE until the handshake is complete.
+     *
+     * @return IOStatus::OK once the handshake completed
+     */
+    IOStatus handshake() {
+        if (mHandshakeDone)
+            return IOStatus::OK;
+
+        int ret = SSL_do_handshake(mSSL.get());
+        if (ret == 1) {
+            // single-use TLS 1.3 tickets were already taken from the cache
+            mHandshakeDone = true;
+            mHandshakeTime = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - mHandshakeStart);
+
+            Metrics::handshakes.add();
+            if (isReused())
+                Metrics::resumptions.add();
+
+#ifdef SSL_OP_ENABLE_KTLS
+            // the send key was installed in the kernel, if it supports the negotiated cipher
+            mKernelSend = BIO_get_ktls_send(SSL_get_wbio(mSSL.get()));
+#endif
+            return IOStatus::OK;
+        }
+
+        IOStatus state = sslStatus(ret);
+        if (state == IOStatus::WANT_READ || state == IOStatus::WANT_WRITE)
+            return state;
+
+        if (SSL_get_error(mSSL.get(), ret) == SSL_ERROR_SSL &&
+                ERR_GET_LIB(ERR_peek_last_error()) == ERR_LIB_SSL &&
+                ERR_GET_REASON(ERR_peek_last_error()) == SSL_R_CERTIFICATE_VERIFY_FAILED) {
+            Metrics::verificationFailures.add();
+            throw ssl_verification_error("Certificate verification failed");
+        }
+        else
+            throw ssl_socket_error("SSL connection failed");
+    }
+
 protected:
+    void setNonBlocking(bool value) override {
+        if (value == mNonBlocking)
+            return;
+        TCPSocket::setNonBlocking(value);
+
+        if (mSSL) {
+            // non-blocking: report every written record and never retry internally
+            if (value) {
+                SSL_clear_mode(mSSL.get(), SSL_MODE_AUTO_RETRY);
+                SSL_set_mode(mSSL.get(), SSL_MODE_ENABLE_PARTIAL_WRITE);
+            }
+            else {
+                SSL_set_mode(mSSL.get(), SSL_MODE_AUTO_RETRY);
+                SSL_clear_mode(mSSL.get(), SSL_MODE_ENABLE_PARTIAL_WRITE);
+            }
+        }
+    }
+
     static int verify_ssl_cert(int pre, X509_STORE_CTX *store) {
         X509 *cert = X509_STORE_CTX_get_current_cert(store);
         if (cert) {
             // get context user data
-            SSLContext &ctx = SSLContext::getInstance();
             SSL *ssl = static_cast<SSL*>(X509_STORE_CTX_get_ex_data(store, SSL_get_ex_data_X509_STORE_CTX_idx()));
-            auto *instance = static_cast<SSLSocket*>(SSL_get_ex_data(ssl, ctx.dataIndex()));
+            auto *instance = static_cast<SSLSocket*>(SSL_get_ex_data(ssl, SSLContext::dataIndex()));
 
             if (instance->mInfo.sslVerify())
-                return instance->mInfo.certStore().verify(pre == 1, X509_get0_pubkey(cert)) ? 1 : 0;
+                return instance->mInfo.certStore().verify(pre == 1, cert) ? 1 : 0;
 
             return 1;
         }
         return 0;
     }
 
-    static int saveSession(SSL *ssl, SSL_SESSION *session) {
-        SSLContext &ctx = SSLContext::getInstance();
-        auto *instance = static_cast<SSLSocket*>(SSL_get_ex_data(ssl, ctx.dataIndex()));
+    /**
+     * Runs the handshake on the non-blocking socket until it completed
+     *
+     * @param deadline Time at which the handshake fails
+     */
+    void handshake(std::chrono::steady_clock::time_point deadline) {
+        setNonBlocking(true);
+        IOStatus state;
+        while ((state = handshake()) != IOStatus::OK) {
+            pollfd fd {};
+            fd.fd = mSocket;
+            fd.events = state == IOStatus::WANT_WRITE ? POLLOUT : POLLIN;
+
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+            if (remaining <= 0 || Native::poll(&fd, 1, static_cast<int>(remaining)) <= 0)
+                throw ssl_socket_error("SSL handshake timed out");
+        }
+        setNonBlocking(false);
+    }
+
+    bool initSSL(uint32_t timeout) {
+        // shared ssl context, verify store is loaded once per location
+        createSSL(SSLContext::getInstance(mInfo.certPath()));
+        // new sessions are cached for our host by the context
+        SSL_set_ex_data(mSSL.get(), SSLContext::infoIndex(), const_cast<ConnectionInfo*>(&mInfo));
 
-        // store session for resumption
-        ctx.saveSession(instance->mInfo, session);
+        // set verification function on the ssl object, the shared context stays untouched
+        SSL_set_verify(mSSL.get(), SSL_VERIFY_PEER, verify_ssl_cert);
+        // set hostname for verification
+        L_assert(SSL_set_tlsext_host_name(mSSL.get(), mInfo.host().c_str()) == 1, ssl_socket_error);
+        SSL_set_connect_state(mSSL.get());
+
+        // try to resume session
+        auto session = mContext->getSession(mInfo);
+        if (session)
+            L_assert(SSL_set_session(mSSL.get(), session.get()) == 1, ssl_socket_error);
+
+        // blocking socket: handshake completes or throws, bounded by the IO timeout unless a timeout is given
+        mHandshakeStart = std::chrono::steady_clock::now();
+        if (timeout > 0)
+            handshake(mHandshakeStart + std::chrono::milliseconds(timeout));
+        else
+            handshake();
 
-        // do not remove session
-        return 1;
+        // only for chaining in connect
+        return true;
     }
 
-    bool initSSL() {
-        // load thread specific ssl context
-        SSLContext &ctx = SSLContext::getInstance();
-        ctx.load(mInfo.certPath());
-        // register session resumption callbacks
-        SSL_CTX_sess_set_new_cb(ctx.get(), saveSession);
-        // set verification function
-        SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_PEER, verify_ssl_cert);
+    /**
+     * Creates the ssl object for this socket, common to client and server side
+     */
+    void createSSL(SSLContext &context) {
+        mContext = &context;
 
         // create ssl object for this socket
-        mSSL.reset(SSL_new(ctx.get()));
+        mSSL.reset(SSL_new(mContext->get()));
         L_assert(mSSL, ssl_socket_error);
-        // set hostname for verification
-        L_assert(SSL_set_tlsext_host_name(mSSL.get(), mInfo.host().c_str()) == 1, ssl_socket_error);
         // store this pointer to access later
-        SSL_set_ex_data(mSSL.get(), ctx.dataIndex(), this);
+        SSL_set_ex_data(mSSL.get(), SSLContext::dataIndex(), this);
         // pass socket to ssl
         L_assert(SSL_set_fd(mSSL.get(), mSocket) == 1, ssl_socket_error);
 
-        // try to resume session
-        SSL_SESSION *session = ctx.getSession(mInfo);
-        if (session)
-            L_assert(SSL_set_session(mSSL.get(), session) == 1, ssl_socket_error);
-
-        // try to connect
-        int ret = SSL_connect(mSSL.get());
-        if (ret != 1 && SSL_get_error(mSSL.get(), ret) == SSL_ERROR_SSL &&
-                ERR_GET_LIB(ERR_peek_last_error()) == ERR_LIB_SSL &&
-                ERR_GET_REASON(ERR_peek_last_error()) == SSL_R_CERTIFICATE_VERIFY_FAILED)
-            throw ssl_verification_error("Certificate verification failed");
-        else if (ret != 1)
-            throw ssl_socket_error("SSL connection failed");
+        // allow retrying a non-blocking SSL_write with a different buffer address holding the same data
+        SSL_set_mode(mSSL.get(), SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
-#ifdef TLS1_3_VERSION
-        // TLSv1.3: recommends that each SSL_SESSION object only used once
-        if (SSL_version(mSSL.get()) == TLS1_3_VERSION)
-            ctx.removeSession(mInfo);
+#ifdef SSL_OP_ENABLE_KTLS
+        // must be set before the handshake, OpenSSL installs the keys in the kernel once they are negotiated
+        if (mInfo.kernelTLS())
+            SSL_set_options(mSSL.get(), SSL_OP_ENABLE_KTLS);
 #endif
+    }
 
-        // only for chaining in connect
-        return true;
+    /**
+     * Maps the result of an SSL_* call to an IOStatus
+     */
+    IOStatus sslStatus(int ret) const {
+        if (ret > 0)
+            return IOStatus::OK;
+
+        switch (SSL_get_error(mSSL.get(), ret)) {
+            case SSL_ERROR_WANT_READ:
+                return IOStatus::WANT_READ;
+            case SSL_ERROR_WANT_WRITE:
+                return IOStatus::WANT_WRITE;
+            case SSL_ERROR_ZERO_RETURN:
+                return IOStatus::CLOSED;
+            case SSL_ERROR_SYSCALL:
+                // EOF without close_notify
+                return ERR_peek_error() == 0 && (ret == 0 || errno == 0) ? IOStatus::CLOSED : IOStatus::FAILED;
+            default:
+                return IOStatus::FAILED;
+        }
     }
 
+    // shared context the ssl object was created from
+    SSLContext *mContext = nullptr;
     // internal ssl object, not thread-safe
     SSL_ref mSSL;
+    // true once the handshake succeeded
+    bool mHandshakeDone = false;
+    // true if outgoing records are encrypted by the kernel
+    bool mKernelSend = false;
+    // handshake timing
+    std::chrono::steady_clock::time_point mHandshakeStart;
+    std::chrono::microseconds mHandshakeTime {0};
 };
 
 #endif //COMMONS_SSLSOCKET_H
@@ -20,6 +20,8 @@
 #ifndef COMMONS_TCPSOCKET_H
 #define COMMONS_TCPSOCKET_H
 
+#include <climits>
+
 #include <network/socket/ISocket.h>
 
 DEFINE_ERROR(socket, base_error);
@@ -28,6 +30,19 @@ class TCPSocket : public ISocket {
 public:
     explicit TCPSocket(const ConnectionInfo &info) : ISocket(info) { }
 
+    /**
+     * Takes ownership of an accepted socket
+     *
+     * @param info Connection information of the peer
+     * @param accepted Socket returned by accept()
+     * @param family Address family of the peer
+     */
+    TCPSocket(const ConnectionInfo &info, SOCKET accepted, int family) : ISocket(info), mSocket(accepted) {
+        setTimeoutIO(mInfo.timeoutIO());
+        setOptions(mInfo.socketOptions());
+        setProtocol(family);
+    }
+
     ~TCPSocket() override {
         if (mSocket != INVALID_SOCKET) {
             // this will gracefully shut down the connection
@@ -37,12 +52,43 @@ public:
     }
 
     bool connect(addrinfo *addr) override {
+        IOStatus status = startConnect(addr);
+
+        if (status == IOStatus::WANT_WRITE) {
+            pollfd fd {};
+            fd.fd = mSocket;
+            fd.events = POLLOUT;
+
+            // no timeout -> pass -1 to block
+            uint32_t t = mInfo.timeoutConnect();
+            int timeout = t > 0 ? static_cast<int>(std::min<uint32_t>(t, INT_MAX)) : -1;
+
+            // waits for socket to complete connect (become writeable), successfully or not
+            if (Native::poll(&fd, 1, timeout) > 0 && !(fd.revents & (POLLERR | POLLHUP | POLLNVAL)) &&
+                    connectSucceeded())
+                status = IOStatus::OK;
+        }
+
+        // timeout or error
+        return status == IOStatus::OK && finishConnect();
+    }
+
+    /**
+     * Creates the socket and starts a non-blocking connect
+     *
+     * @param addr Address to connect to
+     * @return IOStatus::OK if connected immediately, IOStatus::WANT_WRITE if the connect is in progress and the
+     * socket becomes writable once it completed, IOStatus::FAILED if the connect failed
+     */
+    IOStatus startConnect(addrinfo *addr) {
         // try to create socket
         mSocket = Native::socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
         L_assert(mSocket != INVALID_SOCKET, socket_error);
 
         // set r/w timeout
         setTimeoutIO(mInfo.timeoutIO());
+        // apply tuning, buffer sizes must be set before connecting to take effect on the window scale
+        setOptions(mInfo.socketOptions());
         // make socket non-blocking
         setNonBlocking(true);
         // set IP protocol info
@@ -50,77 +96,176 @@ public:
 
         // connect and return immediately
         int res = Native::connect(mSocket, addr->ai_addr, addr->ai_addrlen);
+        if (res == 0)
+            return IOStatus::OK;
 
 #ifdef WIN32
-        if (res == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+        return res == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK ? IOStatus::WANT_WRITE : IOStatus::FAILED;
 #else
-        if (res == SOCKET_ERROR && errno == EINPROGRESS) {
+        return res == SOCKET_ERROR && errno == EINPROGRESS ? IOStatus::WANT_WRITE : IOStatus::FAILED;
 #endif
-            // create a set of sockets for select, add only our socket
-            fd_set set;
-            FD_ZERO(&set);
-            FD_SET(mSocket, &set);
-
-            // timeout in microseconds // TODO: is sec mandatory if usec > 1s?
-            timeval tv = {.tv_sec = 0, .tv_usec = 1000 * static_cast<int32_t>(mInfo.timeoutConnect())};
-            // timeout -> pass NULL to block
-            timeval *ptv = mInfo.timeoutConnect() > 0 ? &tv : nullptr;
-
-            // waits for socket to complete connect (become writeable)
-            if (Native::select(mSocket + 1, nullptr, &set, nullptr, ptv) > 0) {
-                // connect completed - successfully or not
-
-                int error;
-                socklen_t len = sizeof(error);
-                if (Native::getsockopt(mSocket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &len) == 0 && error == 0) {
-                    // connect success
-
-                    // make socket blocking again
-                    setNonBlocking(false);
-                    return true;
-                }
-            }
-        }
+    }
 
-        // timeout or error
-        return false;
+    /**
+     * Creates the socket, binds it to the address and starts listening
+     *
+     * @param addr Local address to bind
+     * @param backlog Maximum number of pending connections
+     * @param reusePort Allow other sockets to bind the same port, the kernel balances connections between them
+     * @return False if the address could not be bound
+     */
+    bool listen(addrinfo *addr, int backlog, bool reusePort) {
+        mSocket = Native::socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        L_assert(mSocket != INVALID_SOCKET, socket_error);
+        setProtocol(addr->ai_family);
+
+#ifndef WIN32
+        // rebind while old connections are in TIME_WAIT, on windows this would allow stealing the port instead
+        setOption(SOL_SOCKET, SO_REUSEADDR, 1);
+#endif
+#ifdef SO_REUSEPORT
+        if (reusePort)
+            setOption(SOL_SOCKET, SO_REUSEPORT, 1);
+#else
+        (void) reusePort;
+#endif
+
+        return Native::bind(mSocket, addr->ai_addr, addr->ai_addrlen) == 0 && Native::listen(mSocket, backlog) == 0;
+    }
+
+    /**
+     * Waits for an incoming connection on a listening socket
+     *
+     * @param address Receives the peer address
+     * @param length Receives the length of the peer address
+     * @return Accepted socket, INVALID_SOCKET on error
+     */
+    SOCKET accept(sockaddr_storage &address, socklen_t &length) {
+        length = sizeof(address);
+        return Native::accept(mSocket, reinterpret_cast<sockaddr*>(&address), &length);
+    }
+
+    /**
+     * Checks the outcome of a connect started by startConnect() once the socket became writable
+     *
+     * @return True if the connect completed successfully
+     */
+    bool connectSucceeded() {
+        int error;
+        socklen_t len = sizeof(error);
+        return Native::getsockopt(mSocket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &len) == 0
+               && error == 0;
+    }
+
+    /**
+     * Completes a successful connect by making the socket blocking again
+     *
+     * @param timeout Maximum duration of further connection setup (e.g. a TLS handshake) in milliseconds, 0 for the
+     * IO timeout
+     * @return True on success
+     */
+    virtual bool finishConnect(uint32_t timeout = 0) {
+        setNonBlocking(false);
+        return true;
     }
 
     ssize_t read(void *data, uint32_t size) override {
-        return Native::recv(mSocket, data, size);
+        setBlockingMode(true);
+        ssize_t res = Native::recv(mSocket, data, size);
+        if (res > 0)
+            rearmQuickAck();
+        return res;
     }
 
     ssize_t write(const void *data, uint32_t size) override {
+        setBlockingMode(true);
         return Native::send(mSocket, data, size);
     }
 
+    ssize_t writev(const IOVector *vectors, uint32_t count) override {
+        setBlockingMode(true);
+        return Native::sendv(mSocket, vectors, count);
+    }
+
+    ssize_t sendFile(int fd, uint64_t offset, uint32_t size) override {
+        setBlockingMode(true);
+        return Native::sendfile(mSocket, fd, offset, size);
+    }
+
+    IOStatus readNonBlocking(void *data, uint32_t size, uint32_t &read) override {
+        read = 0;
+
+        setBlockingMode(false);
+        ssize_t res = Native::recv(mSocket, data, size, NW__MSG_DONTWAIT);
+        if (res > 0) {
+            read = static_cast<uint32_t>(res);
+            rearmQuickAck();
+        }
+        return status(res);
+    }
+
+    IOStatus writeNonBlocking(const void *data, uint32_t size, uint32_t &written) override {
+        written = 0;
+
+        setBlockingMode(false);
+        ssize_t res = Native::send(mSocket, data, size, NW__MSG_DONTWAIT);
+        if (res > 0)
+            written = static_cast<uint32_t>(res);
+        return res < 0 && wouldBlock() ? IOStatus::WANT_WRITE : status(res);
+    }
+
+    /**
+     * @param ms Time in milliseconds
+     * @return Time as timeval
+     */
+    static timeval toTimeval(uint32_t ms) {
+        timeval tv {};
+        tv.tv_sec = ms / 1000;
+        tv.tv_usec = 1000 * (ms % 1000);
+        return tv;
+    }
+
+    NativeSocket fd() const override {
+        return mSocket;
+    }
+
+protected:
     /**
-     * Sets the non-blocking state.
+     * Sets the non-blocking state. Only changes cost a syscall, the state is cached.
      *
      * @param value True for non-blocking, false for blocking
      */
-    void setNonBlocking(bool value) {
+    virtual void setNonBlocking(bool value) {
+        if (value == mNonBlocking)
+            return;
+        mNonBlocking = value;
+
 #ifdef WIN32
         u_long mode = value ? 1 : 0;
         ioctlsocket(mSocket, FIONBIO, &mode);
 #else
-        int flags = fcntl(mSocket, F_GETFL, NULL);
-        if (value)
-            flags |= O_NONBLOCK;
-        else
-            flags &= ~O_NONBLOCK;
-        fcntl(mSocket, F_SETFL, flags);
+        // the other status flags do not change, read them once
+        if (mFlags < 0)
+            mFlags = fcntl(mSocket, F_GETFL, NULL) & ~O_NONBLOCK;
+        fcntl(mSocket, F_SETFL, value ? mFlags | O_NONBLOCK : mFlags);
 #endif
     }
 
     /**
-     * @return Underlying socket
+     * Prepares the socket for a blocking or non-blocking call. Where MSG_DONTWAIT exists, non-blocking calls pass
+     * it and the socket stays blocking. Otherwise the socket keeps the mode of the last call, so a series of calls
+     * of the same kind switches it only once.
+     *
+     * @param blocking True before a blocking call, false before a non-blocking call
      */
-    SOCKET fd() const {
-        return mSocket;
+    void setBlockingMode(bool blocking) {
+#ifdef WIN32
+        setNonBlocking(!blocking);
+#else
+        (void) blocking;
+#endif
     }
 
-protected:
     /**
      * Sets the send and receive timeouts.
      *
@@ -133,13 +278,97 @@ protected:
 #ifdef WIN32
         DWORD tv = t;
 #else
-        timeval tv = { .tv_sec = 0, .tv_usec = 1000 * static_cast<int32_t>(t) };
+        timeval tv = toTimeval(t);
 #endif
 
         setsockopt(mSocket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&tv), sizeof(tv));
         setsockopt(mSocket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&tv), sizeof(tv));
     }
 
+    /**
+     * Applies tuning options, failures are ignored since all options are optimizations
+     *
+     * @param options Options to apply
+     */
+    void setOptions(const SocketOptions &options) {
+        if (options.noDelay)
+            setOption(IPPROTO_TCP, TCP_NODELAY, 1);
+        if (options.sendBuffer > 0)
+            setOption(SOL_SOCKET, SO_SNDBUF, options.sendBuffer);
+        if (options.receiveBuffer > 0)
+            setOption(SOL_SOCKET, SO_RCVBUF, options.receiveBuffer);
+
+        if (options.keepAlive) {
+            setOption(SOL_SOCKET, SO_KEEPALIVE, 1);
+#ifdef TCP_KEEPIDLE
+            if (options.keepAliveIdle > 0)
+                setOption(IPPROTO_TCP, TCP_KEEPIDLE, options.keepAliveIdle);
+#endif
+#ifdef TCP_KEEPINTVL
+            if (options.keepAliveInterval > 0)
+                setOption(IPPROTO_TCP, TCP_KEEPINTVL, options.keepAliveInterval);
+#endif
+#ifdef TCP_KEEPCNT
+            if (options.keepAliveCount > 0)
+                setOption(IPPROTO_TCP, TCP_KEEPCNT, options.keepAliveCount);
+#endif
+        }
+
+#ifdef TCP_USER_TIMEOUT
+        if (options.userTimeout > 0)
+            setOption(IPPROTO_TCP, TCP_USER_TIMEOUT, options.userTimeout);
+#endif
+#ifdef SO_BUSY_POLL
+        if (options.busyPoll > 0)
+            setOption(SOL_SOCKET, SO_BUSY_POLL, options.busyPoll);
+#endif
+        rearmQuickAck();
+    }
+
+    /**
+     * Sets an integer socket option
+     */
+    bool setOption(int level, int name, uint32_t value) {
+        auto v = static_cast<int>(value);
+        return setsockopt(mSocket, level, name, reinterpret_cast<const char*>(&v), sizeof(v)) == 0;
+    }
+
+    /**
+     * Sets TCP_QUICKACK again if enabled, since the kernel falls back to delayed ACKs on its own. Costs a syscall, so
+     * it is only called after reads that returned data.
+     */
+    void rearmQuickAck() {
+#ifdef TCP_QUICKACK
+        if (mInfo.socketOptions().quickAck)
+            setOption(IPPROTO_TCP, TCP_QUICKACK, 1);
+#endif
+    }
+
+    /**
+     * @return True if the last socket operation failed because it would block
+     */
+    static bool wouldBlock() {
+#ifdef WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+    }
+
+    /**
+     * Maps the result of a recv/send call to an IOStatus
+     */
+    static IOStatus status(ssize_t res) {
+        if (res > 0)
+            return IOStatus::OK;
+        else if (res == 0)
+            return IOStatus::CLOSED;
+        else if (wouldBlock())
+            return IOStatus::WANT_READ;
+        else
+            return IOStatus::FAILED;
+    }
+
     void setProtocol(int ai_family) {
         if (ai_family == AF_INET)
             mProtocol = IPProtocol::IPv4;
@@ -148,6 +377,12 @@ protected:
     }
 
     SOCKET mSocket = INVALID_SOCKET;
+    // cached non-blocking state
+    bool mNonBlocking = false;
+#ifndef WIN32
+    // cached file status flags without O_NONBLOCK
+    int mFlags = -1;
+#endif
 };
 
 #endif //COMMONS_TCPSOCKET_H
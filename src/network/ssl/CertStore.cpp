@@ -25,6 +25,34 @@ CertStore CertStore::mInstance;
 using BIO_ref = std::unique_ptr<BIO, decltype(&BIO_free)>;
 using EVP_PKEY_ref = std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
 
+/**
+ * Hashes a DER encoding, using a stack buffer for all common key sizes
+ *
+ * @param encode i2d style function, called once for the size and once for the encoding
+ */
+template<typename F>
+static bool spkiDigest(F encode, CertStore::Digest &digest) {
+    int size = encode(nullptr);
+    if (size <= 0)
+        return false;
+
+    // fits RSA keys up to 16384 bits
+    uint8_t stack[2200];
+    std::vector<uint8_t> heap;
+    uint8_t *der = stack;
+    if (static_cast<size_t>(size) > sizeof(stack)) {
+        heap.resize(static_cast<size_t>(size));
+        der = heap.data();
+    }
+
+    uint8_t *out = der;
+    if (encode(&out) != size)
+        return false;
+
+    SHA256(der, static_cast<size_t>(size), digest.data());
+    return true;
+}
+
 uint16_t CertStore::addKey(const Buffer &key, CertStore::Mode mode) {
     // create memory bio
     BIO_ref pubKeyBIO(BIO_new(BIO_s_mem()), &BIO_free);
@@ -34,16 +62,19 @@ uint16_t CertStore::addKey(const Buffer &key, CertStore::Mode mode) {
     int res = BIO_write(pubKeyBIO.get(), key.const_data(), key.size());
     L_assert(res >= 0 && static_cast<uint32_t>(res) == key.size(), cert_error);
 
-    // parse the PEM private key data
-    RSA_ref pubKeyRSA(PEM_read_bio_RSA_PUBKEY(pubKeyBIO.get(), nullptr, nullptr, nullptr), &RSA_free);
-    L_assert(pubKeyRSA, cert_error);
+    // parse the PEM public key data, any key type
+    EVP_PKEY_ref pubKey(PEM_read_bio_PUBKEY(pubKeyBIO.get(), nullptr, nullptr, nullptr), &EVP_PKEY_free);
+    L_assert(pubKey, cert_error);
+
+    Digest pubKeyDigest;
+    L_assert(digest(pubKey.get(), pubKeyDigest), cert_error);
 
     // operations on key container and key id need to be guarded
     std::lock_guard<std::mutex> guard(mLock);
 
     uint16_t id = mNextID++;
-    PublicKey storedKey(mode, pubKeyRSA);
-    mPublicKeys.insert(std::make_pair(id, std::move(storedKey)));
+    mPublicKeys.emplace(id, PublicKey(mode, pubKeyDigest));
+    publish();
     return id;
 }
 
@@ -57,6 +88,7 @@ void CertStore::setMode(uint16_t id, CertStore::Mode mode) {
 
     // assign new mode
     elem->second.mode = mode;
+    publish();
 }
 
 CertStore::Mode CertStore::getMode(uint16_t id) {
@@ -79,32 +111,54 @@ void CertStore::removeKey(uint16_t id) {
     auto elem = mPublicKeys.find(id);
     L_assert(elem != mPublicKeys.end(), cert_error);
 
-    // remove key, this frees its resources as well
     mPublicKeys.erase(elem);
+    publish();
 }
 
 bool CertStore::verify(bool pre, const EVP_PKEY *key) const {
-    for (auto &publicKey : mPublicKeys) {
-        // wrap the key in a EVP_PKEY
-        EVP_PKEY_ref evpKey(EVP_PKEY_new(), &EVP_PKEY_free);
-        EVP_PKEY_set1_RSA(evpKey.get(), publicKey.second.data.get());
-
-        // compare it to the given key
-        if (EVP_PKEY_cmp(key, evpKey.get()) == 1) {
-            switch (publicKey.second.mode) {
-                case Mode::DENY:
-                    return false;
-                case Mode::ALLOW:
-                    return true;
-                case Mode::UNDECIDED:
-                    return pre;
-            }
-        }
-        else
-            // do not match, different key types, unsupported
-            continue;
+    Digest keyDigest;
+    return digest(key, keyDigest) ? verify(pre, keyDigest) : pre;
+}
+
+bool CertStore::verify(bool pre, const X509 *cert) const {
+    // encode the certificate's existing SubjectPublicKeyInfo
+    X509_PUBKEY *pubKey = X509_get_X509_PUBKEY(cert);
+    if (!pubKey)
+        return pre;
+
+    Digest keyDigest;
+    bool encoded = spkiDigest([pubKey] (uint8_t **out) { return i2d_X509_PUBKEY(pubKey, out); }, keyDigest);
+    return encoded ? verify(pre, keyDigest) : pre;
+}
+
+bool CertStore::digest(const EVP_PKEY *key, Digest &digest) {
+    // i2d_PUBKEY does not modify the key, but takes non-const on older OpenSSL
+    auto *pubKey = const_cast<EVP_PKEY*>(key);
+    return spkiDigest([pubKey] (uint8_t **out) { return i2d_PUBKEY(pubKey, out); }, digest);
+}
+
+bool CertStore::verify(bool pre, const Digest &digest) const {
+    // no lock: the snapshot stays valid while referenced, even if a writer publishes a new one
+    std::shared_ptr<const Index> index = std::atomic_load(&mIndex);
+
+    auto elem = index->find(digest);
+    if (elem == index->end() || elem->second == Mode::UNDECIDED)
+        // unknown or undecided key: pre
+        return pre;
+
+    return elem->second == Mode::ALLOW;
+}
+
+void CertStore::publish() {
+    auto index = std::make_shared<Index>();
+    index->reserve(mPublicKeys.size());
+
+    for (auto &key : mPublicKeys) {
+        // a key added multiple times: DENY takes precedence over ALLOW over UNDECIDED
+        auto elem = index->emplace(key.second.digest, key.second.mode).first;
+        if (key.second.mode == Mode::DENY || (key.second.mode == Mode::ALLOW && elem->second == Mode::UNDECIDED))
+            elem->second = key.second.mode;
     }
 
-    // default: pre
-    return pre;
+    std::atomic_store(&mIndex, std::shared_ptr<const Index>(std::move(index)));
 }
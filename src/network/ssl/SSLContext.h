@@ -20,99 +20,282 @@
 #ifndef COMMONS_SSLCONTEXT_H
 #define COMMONS_SSLCONTEXT_H
 
+#include <fstream>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 #include <network/ConnectionInfo.h>
 
+#include "SessionCache.h"
+
+DEFINE_ERROR(ssl_context, base_error);
+
 /**
- * Wrapper class for OpenSSL's SSL_CTX. Each thread has one static singleton SSLContext assigned to save the
- * sessions on a per-thread basis.
+ * Wrapper class for OpenSSL's SSL_CTX. One context is shared by all threads for each verify location, so the trust
+ * store is loaded once and sessions can be resumed from any thread. SSL_CTX itself is thread-safe once configured,
+ * the session cache is guarded by striped locks.
+ *
+ * Sessions are cached per host in a bounded LRU cache and can be persisted across processes.
+ *
+ * Server contexts are shared per certificate and key, they resume sessions with tickets and OpenSSL's internal cache.
  */
 class SSLContext {
     using SSL_CTX_ref = std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)>;
-    using SSL_SESSION_ref = std::unique_ptr<SSL_SESSION, decltype(&SSL_SESSION_free)>;
 public:
+    using SSL_SESSION_ref = SessionCache::SSL_SESSION_ref;
+
     /**
-     * @return SSLContext singleton associated with this thread
+     * @param certPath Verify location, empty for the system default store
+     * @return Shared SSLContext for the verify location
      */
-    static SSLContext &getInstance() {
-        return mInstance;
+    static SSLContext &getInstance(const std::string &certPath = "") {
+        static std::mutex lock;
+        static std::unordered_map<std::string, std::unique_ptr<SSLContext>> instances;
+
+        std::lock_guard<std::mutex> guard(lock);
+        auto &instance = instances[certPath];
+        if (!instance)
+            instance.reset(new SSLContext(certPath));
+
+        return *instance;
     }
 
     /**
-     * @return Native SSL_CTX
+     * @param certChain PEM file containing the certificate chain, starting with the server certificate
+     * @param privateKey PEM file containing the private key of the server certificate
+     * @return Shared server SSLContext for the certificate and key
      */
-    SSL_CTX *get() {
-        return mCtx.get();
+    static SSLContext &getServerInstance(const std::string &certChain, const std::string &privateKey) {
+        static std::mutex lock;
+        static std::unordered_map<std::string, std::unique_ptr<SSLContext>> instances;
+
+        std::lock_guard<std::mutex> guard(lock);
+        auto &instance = instances[certChain + '\n' + privateKey];
+        if (!instance)
+            instance.reset(new SSLContext(certChain, privateKey));
+
+        return *instance;
     }
 
-    int dataIndex() const {
-        return mDataIndex;
+    /**
+     * @return Process-wide ssl data index used to pass custom data to callbacks
+     */
+    static int dataIndex() {
+        static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
     }
 
     /**
-     * Loads the context for verification
-     *
-     * @param certPath If given, passed to SSL load_verify_locations
+     * @return Process-wide ssl data index of the ConnectionInfo that new client sessions are cached for
      */
-    void load(const std::string &certPath) {
-        if (certPath.empty())
-            Native::gInit.defaultStore(get());
-        else
-            L_expect(SSL_CTX_load_verify_locations(get(), nullptr, certPath.c_str()));
+    static int infoIndex() {
+        static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    /**
+     * @return Native SSL_CTX
+     */
+    SSL_CTX *get() {
+        return mCtx.get();
     }
 
     /**
      * Saves a session associated in session cache
      *
      * @param info Associated connection information
-     * @param session Native OpenSSL SSL context
+     * @param session Native OpenSSL SSL context, ownership is taken
      */
     void saveSession(const ConnectionInfo &info, SSL_SESSION *session) {
-        mSessions.emplace(info.hash(), SSL_SESSION_ref(session, &SSL_SESSION_free));
+        saveSession(key(info), session);
     }
 
     /**
-     * Returns a session from session cache
+     * Returns a session from session cache. Single-use TLS 1.3 tickets are removed from the cache.
      *
      * @param info Associated connection information
-     * @return Saved session to resume
+     * @return Saved session to resume with its own reference, since another thread may remove it from the cache
      */
-    SSL_SESSION *getSession(const ConnectionInfo &info) {
-        auto elem = mSessions.find(info.hash());
-        return elem == mSessions.end() ? nullptr : elem->second.get();
+    SSL_SESSION_ref getSession(const ConnectionInfo &info) {
+        std::string k = key(info);
+        Stripe &stripe = stripeOf(k);
+        std::lock_guard<std::mutex> guard(stripe.lock);
+
+        return stripe.sessions.take(k);
     }
 
     /**
-     * Removes a session from session cache
+     * Removes all sessions of a host from session cache
      *
      * @param info Associated connection information
      */
     void removeSession(const ConnectionInfo &info) {
-        mSessions.erase(info.hash());
+        std::string k = key(info);
+        Stripe &stripe = stripeOf(k);
+        std::lock_guard<std::mutex> guard(stripe.lock);
+
+        stripe.sessions.remove(k);
+    }
+
+    /**
+     * Writes all cached sessions to a file, so another process can resume them
+     *
+     * @param path File to write, replaced if it exists
+     * @return False if the file could not be written
+     */
+    bool storeSessions(const std::string &path) {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+
+        for (auto &stripe : mStripes) {
+            std::lock_guard<std::mutex> guard(stripe.lock);
+
+            stripe.sessions.forEach([&file] (const std::string &k, SSL_SESSION *session) {
+                int size = i2d_SSL_SESSION(session, nullptr);
+                if (size <= 0)
+                    return;
+
+                std::vector<uint8_t> der(static_cast<size_t>(size));
+                uint8_t *out = der.data();
+                i2d_SSL_SESSION(session, &out);
+
+                // record: key size, key, session size, session
+                auto keySize = static_cast<uint32_t>(k.size()), derSize = static_cast<uint32_t>(size);
+                file.write(reinterpret_cast<const char*>(&keySize), sizeof(keySize));
+                file.write(k.data(), keySize);
+                file.write(reinterpret_cast<const char*>(&derSize), sizeof(derSize));
+                file.write(reinterpret_cast<const char*>(der.data()), derSize);
+            });
+        }
+
+        return static_cast<bool>(file);
+    }
+
+    /**
+     * Adds sessions written by storeSessions to the cache. Expired sessions are skipped.
+     *
+     * @param path File to read
+     * @return Number of sessions read
+     */
+    uint32_t loadSessions(const std::string &path) {
+        std::ifstream file(path, std::ios::binary);
+        uint32_t count = 0, keySize, derSize;
+
+        while (file.read(reinterpret_cast<char*>(&keySize), sizeof(keySize))) {
+            // sanity limits against corrupted files
+            if (keySize > 1024)
+                break;
+            std::string k(keySize, '\0');
+            if (!file.read(&k[0], keySize) || !file.read(reinterpret_cast<char*>(&derSize), sizeof(derSize)) ||
+                    derSize > 64 * 1024)
+                break;
+
+            std::vector<uint8_t> der(derSize);
+            if (!file.read(reinterpret_cast<char*>(der.data()), derSize))
+                break;
+
+            const uint8_t *in = der.data();
+            SSL_SESSION *session = d2i_SSL_SESSION(nullptr, &in, derSize);
+            if (!session)
+                break;
+
+            saveSession(k, session);
+            count++;
+        }
+
+        return count;
     }
 
 protected:
+    // number of session cache locks
+    static const size_t STRIPES = 16;
+    // maximum number of hosts with cached sessions
+    static const size_t SESSION_HOSTS = 1024;
+    // maximum number of sessions (TLS 1.3 tickets) per host
+    static const size_t SESSIONS_PER_HOST = 4;
+
+    struct Stripe {
+        std::mutex lock;
+        // saved sessions for resumption
+        SessionCache sessions {SESSION_HOSTS / STRIPES, SESSIONS_PER_HOST};
+    };
+
     /**
-     * Constructor used internally to create singleton instance.
+     * Constructor used internally to create shared instances.
+     *
+     * @param certPath If given, passed to SSL load_verify_locations
      */
-    explicit SSLContext() : mCtx(SSL_CTX_new(TLS_client_method()), &SSL_CTX_free) {
+    explicit SSLContext(const std::string &certPath) : mCtx(SSL_CTX_new(TLS_client_method()), &SSL_CTX_free) {
         // simplify application logic by removing need for manually handling SSL state
         SSL_CTX_set_mode(get(), SSL_MODE_AUTO_RETRY);
-        // data index used to pass custom data to ssl verify
-        mDataIndex = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
-        // set session caching mode to cache client sessions
+        // set session caching mode to cache client sessions, new sessions go to our cache. Configured here, since the
+        // SSL_CTX must not be modified once it is shared between threads.
         SSL_CTX_set_session_cache_mode(get(), SSL_SESS_CACHE_CLIENT);
+        SSL_CTX_set_app_data(get(), this);
+        SSL_CTX_sess_set_new_cb(get(), newSession);
+
+        // load verify store once
+        if (certPath.empty())
+            Native::gInit.defaultStore(get());
+        else
+            L_expect(SSL_CTX_load_verify_locations(get(), nullptr, certPath.c_str()));
     }
 
-    // thread specific singleton
-    static thread_local SSLContext mInstance;
+    /**
+     * Constructor used internally to create shared server instances.
+     *
+     * @param certChain PEM certificate chain file
+     * @param privateKey PEM private key file
+     */
+    SSLContext(const std::string &certChain, const std::string &privateKey)
+            : mCtx(SSL_CTX_new(TLS_server_method()), &SSL_CTX_free) {
+        L_assert(mCtx, ssl_context_error);
+        SSL_CTX_set_mode(get(), SSL_MODE_AUTO_RETRY);
+
+        // resumption by session id needs a context, tickets work without
+        static const unsigned char sessionContext[] = "commons";
+        SSL_CTX_set_session_cache_mode(get(), SSL_SESS_CACHE_SERVER);
+        SSL_CTX_set_session_id_context(get(), sessionContext, sizeof(sessionContext) - 1);
+
+        L_assert(SSL_CTX_use_certificate_chain_file(get(), certChain.c_str()) == 1, ssl_context_error);
+        L_assert(SSL_CTX_use_PrivateKey_file(get(), privateKey.c_str(), SSL_FILETYPE_PEM) == 1, ssl_context_error);
+        L_assert(SSL_CTX_check_private_key(get()) == 1, ssl_context_error);
+    }
+
+    /**
+     * Called by OpenSSL if a new client session was negotiated
+     */
+    static int newSession(SSL *ssl, SSL_SESSION *session) {
+        auto *context = static_cast<SSLContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+        auto *info = static_cast<const ConnectionInfo*>(SSL_get_ex_data(ssl, infoIndex()));
+        if (!info)
+            return 0;
+
+        // store session for resumption, takes the reference
+        context->saveSession(*info, session);
+        return 1;
+    }
+
+    static std::string key(const ConnectionInfo &info) {
+        return info.host() + ":" + std::to_string(info.port());
+    }
+
+    void saveSession(const std::string &k, SSL_SESSION *session) {
+        Stripe &stripe = stripeOf(k);
+        std::lock_guard<std::mutex> guard(stripe.lock);
+
+        stripe.sessions.put(k, session);
+    }
+
+    Stripe &stripeOf(const std::string &k) {
+        return mStripes[std::hash<std::string>()(k) % STRIPES];
+    }
 
     // native context
     SSL_CTX_ref mCtx;
-    // ssl data index for custom data
-    int mDataIndex;
-    // saved sessions for resumption
-    std::unordered_map<size_t, SSL_SESSION_ref> mSessions;
+    // session cache
+    Stripe mStripes[STRIPES];
 };
 
 #endif //COMMONS_SSLCONTEXT_H
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2019 The ViaDuck Project
+ *
+ * This file is part of Commons.
+ *
+ * Commons is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Commons is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMONS_SESSIONCACHE_H
+#define COMMONS_SESSIONCACHE_H
+
+#include <ctime>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <openssl/ssl.h>
+
+/**
+ * Bounded LRU cache of TLS sessions by host. Keeps several single-use TLS 1.3 tickets per host, but only the newest
+ * TLS 1.2 session. Expired sessions are dropped on access. Not thread-safe.
+ */
+class SessionCache {
+public:
+    using SSL_SESSION_ref = std::unique_ptr<SSL_SESSION, decltype(&SSL_SESSION_free)>;
+
+    /**
+     * @param capacity Maximum number of hosts, the least recently used host is evicted
+     * @param perHost Maximum number of sessions per host, the oldest session is evicted
+     */
+    SessionCache(size_t capacity, size_t perHost) : mCapacity(capacity), mPerHost(perHost) { }
+
+    /**
+     * Adds a session
+     *
+     * @param key Host the session belongs to
+     * @param session Session, ownership is taken
+     */
+    void put(const std::string &key, SSL_SESSION *session) {
+        SSL_SESSION_ref ref(session, &SSL_SESSION_free);
+        if (expired(session))
+            return;
+
+        Entry &entry = touch(key);
+
+        // a new TLS 1.2 session supersedes all previous ones
+        if (!singleUse(session))
+            entry.sessions.clear();
+
+        entry.sessions.emplace_front(std::move(ref));
+        if (entry.sessions.size() > mPerHost)
+            entry.sessions.pop_back();
+
+        // evict least recently used host
+        if (mIndex.size() > mCapacity) {
+            mIndex.erase(mEntries.back().key);
+            mEntries.pop_back();
+        }
+    }
+
+    /**
+     * Returns the newest valid session of a host. Single-use TLS 1.3 tickets are removed from the cache.
+     *
+     * @param key Host
+     * @return Session with its own reference, nullptr if none is available
+     */
+    SSL_SESSION_ref take(const std::string &key) {
+        auto elem = mIndex.find(key);
+        if (elem == mIndex.end())
+            return SSL_SESSION_ref(nullptr, &SSL_SESSION_free);
+
+        Entry &entry = touch(key);
+        auto &sessions = entry.sessions;
+
+        // drop expired sessions, newest first
+        while (!sessions.empty() && expired(sessions.front().get()))
+            sessions.pop_front();
+
+        SSL_SESSION_ref result(nullptr, &SSL_SESSION_free);
+        if (!sessions.empty()) {
+            if (singleUse(sessions.front().get())) {
+                result = std::move(sessions.front());
+                sessions.pop_front();
+            }
+            else {
+                SSL_SESSION_up_ref(sessions.front().get());
+                result.reset(sessions.front().get());
+            }
+        }
+
+        if (sessions.empty())
+            remove(key);
+        return result;
+    }
+
+    /**
+     * Removes all sessions of a host
+     *
+     * @param key Host
+     */
+    void remove(const std::string &key) {
+        auto elem = mIndex.find(key);
+        if (elem == mIndex.end())
+            return;
+
+        mEntries.erase(elem->second);
+        mIndex.erase(elem);
+    }
+
+    /**
+     * Calls f(key, session) for all sessions, from least to most recently used
+     */
+    template<typename F>
+    void forEach(F f) const {
+        for (auto entry = mEntries.rbegin(); entry != mEntries.rend(); ++entry)
+            for (auto session = entry->sessions.rbegin(); session != entry->sessions.rend(); ++session)
+                f(entry->key, session->get());
+    }
+
+    /**
+     * @return Number of hosts
+     */
+    size_t size() const {
+        return mIndex.size();
+    }
+
+protected:
+    struct Entry {
+        std::string key;
+        // newest session first
+        std::deque<SSL_SESSION_ref> sessions;
+    };
+
+    static bool singleUse(SSL_SESSION *session) {
+#ifdef TLS1_3_VERSION
+        // TLSv1.3: recommends that each SSL_SESSION object only used once
+        return SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION;
+#else
+        return false;
+#endif
+    }
+
+    static bool expired(SSL_SESSION *session) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        if (!SSL_SESSION_is_resumable(session))
+            return true;
+#endif
+        return SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) <= std::time(nullptr);
+    }
+
+    // finds or creates the entry and marks it as most recently used
+    Entry &touch(const std::string &key) {
+        auto elem = mIndex.find(key);
+        if (elem != mIndex.end()) {
+            mEntries.splice(mEntries.begin(), mEntries, elem->second);
+            return mEntries.front();
+        }
+
+        mEntries.push_front({key, {}});
+        mIndex.emplace(key, mEntries.begin());
+        return mEntries.front();
+    }
+
+    size_t mCapacity, mPerHost;
+    // most recently used first
+    std::list<Entry> mEntries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> mIndex;
+};
+
+#endif //COMMONS_SESSIONCACHE_H
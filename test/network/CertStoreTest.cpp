@@ -17,6 +17,9 @@
  * along with Commons.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
+#include <thread>
+
 #include <secure_memory/String.h>
 #include <openssl/pem.h>
 #include "CertStoreTest.h"
@@ -57,6 +60,14 @@ const char VALID_KEY_2[] = "-----BEGIN PUBLIC KEY-----\n"
         "jQIDAQAB\n"
         "-----END PUBLIC KEY-----";
 
+const char VALID_KEY_EC[] = "-----BEGIN PUBLIC KEY-----\n"
+        "MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAEIStPtPAAPm55LwhTEsqwSVmJrWz4\n"
+        "njkDVWhm+YO3161lCFjrEwup+M8JxC23kuOoR9kQRz6nnB6zn/TCQgzTpA==\n"
+        "-----END PUBLIC KEY-----";
+const char VALID_KEY_ED25519[] = "-----BEGIN PUBLIC KEY-----\n"
+        "MCowBQYDK2VwAyEAGc+tUbvi3xUvod+rnKCXLBOtAykn08LIMgYGAmq7Dxc=\n"
+        "-----END PUBLIC KEY-----";
+
 const char INVALID_KEY_0[] = "-----BEGIN PUBLIC KEY-----\n"
         "MIICIjANBgkqhkiG9w0BAQEFAAOCAg8AMIICCgKCAgEA4tmmlX6LxHFfkUr+L3Tz\n"
         "Mfyw2RrkPvIgtSgtwHEIIQq5By3zsT0m8pNfpspascIQjtJ47A+HkbAgzn0tQvuI\n"
@@ -225,3 +236,72 @@ TEST_F(CertStoreTest, check) {
     EXPECT_EQ(0, mStore.verify(1, key1EVP.get()));
     EXPECT_EQ(0, mStore.verify(0, keyUnknownEVP.get()));
 }
+
+TEST_F(CertStoreTest, checkKeyTypes) {
+    using EVP_PKEY_ref = std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
+    using X509_ref = std::unique_ptr<X509, decltype(&X509_free)>;
+
+    // parses a PEM public key of any type
+    auto parse = [] (const String &pem) {
+        std::unique_ptr<BIO, decltype(&BIO_free)> bio(BIO_new_mem_buf(pem.const_data(), pem.size()), &BIO_free);
+        return EVP_PKEY_ref(PEM_read_bio_PUBKEY(bio.get(), nullptr, nullptr, nullptr), &EVP_PKEY_free);
+    };
+    EVP_PKEY_ref ec = parse(KEY_STRING(VALID_KEY_EC)), ed25519 = parse(KEY_STRING(VALID_KEY_ED25519));
+    ASSERT_TRUE(ec && ed25519);
+
+    uint16_t idEC, idEd25519;
+    ASSERT_NO_THROW(idEC = mStore.addKey(KEY_STRING(VALID_KEY_EC), CertStore::Mode::ALLOW));
+    ASSERT_NO_THROW(idEd25519 = mStore.addKey(KEY_STRING(VALID_KEY_ED25519), CertStore::Mode::DENY));
+
+    EXPECT_TRUE(mStore.verify(false, ec.get()));
+    EXPECT_FALSE(mStore.verify(true, ed25519.get()));
+
+    // certificate carrying the EC key
+    X509_ref cert(X509_new(), &X509_free);
+    ASSERT_EQ(1, X509_set_pubkey(cert.get(), ec.get()));
+    EXPECT_TRUE(mStore.verify(false, cert.get()));
+
+    // same key added twice: deny wins until removed
+    uint16_t idDeny;
+    ASSERT_NO_THROW(idDeny = mStore.addKey(KEY_STRING(VALID_KEY_EC), CertStore::Mode::DENY));
+    EXPECT_FALSE(mStore.verify(true, cert.get()));
+    ASSERT_NO_THROW(mStore.removeKey(idDeny));
+    EXPECT_TRUE(mStore.verify(false, cert.get()));
+
+    // removed keys fall back to pre verification
+    ASSERT_NO_THROW(mStore.removeKey(idEC));
+    ASSERT_NO_THROW(mStore.removeKey(idEd25519));
+    EXPECT_FALSE(mStore.verify(false, ec.get()));
+    EXPECT_TRUE(mStore.verify(true, ed25519.get()));
+}
+
+TEST_F(CertStoreTest, concurrentRotation) {
+    String pem = KEY_STRING(VALID_KEY_EC);
+    std::unique_ptr<BIO, decltype(&BIO_free)> bio(BIO_new_mem_buf(pem.const_data(), pem.size()), &BIO_free);
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(PEM_read_bio_PUBKEY(bio.get(), nullptr, nullptr, nullptr),
+            &EVP_PKEY_free);
+    ASSERT_TRUE(key);
+
+    uint16_t id;
+    ASSERT_NO_THROW(id = mStore.addKey(pem, CertStore::Mode::ALLOW));
+
+    // handshake threads verify while the key is rotated between ALLOW and DENY
+    std::atomic<bool> stop(false);
+    std::atomic<uint32_t> allowed(0), denied(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back([&] () {
+            while (!stop)
+                (mStore.verify(false, key.get()) ? allowed : denied)++;
+        });
+
+    for (int i = 0; i < 1000; i++)
+        mStore.setMode(id, i % 2 ? CertStore::Mode::ALLOW : CertStore::Mode::DENY);
+    stop = true;
+    for (auto &reader : readers)
+        reader.join();
+
+    // every verify saw a consistent snapshot, the last rotation is visible
+    EXPECT_GT(allowed + denied, 0u);
+    EXPECT_TRUE(mStore.verify(false, key.get()));
+}
@@ -23,7 +23,8 @@
 #include <gtest/gtest.h>
 
 class ConnectionTest : public ::testing::Test {
-
+protected:
+    void SetUp() override;
 };
 
 